@@ -0,0 +1,249 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import argparse
+import glob
+import hashlib
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+BENCH = os.path.dirname(os.path.abspath(__file__))
+MCU = os.path.join(BENCH, '..', 'mcu')
+PC = os.path.join(BENCH, '..', '..', 'PC')
+WORKLOADS = os.path.join(BENCH, 'workloads')
+GOLDEN = os.path.join(BENCH, 'golden')
+
+sys.path.insert(0, PC)
+from shapes import Line, Circle, Arc, Polyline, Bezier, shapesToCommands
+
+SOURCES = [os.path.join(MCU, name) for name in ('main.c', 'hilbert.c', 'job.c')] + \
+          [os.path.join(BENCH, 'sim', 'sim.c')]
+
+# Metrics that must not grow, the trace must stay the same
+LIMITED = ['ticks', 'time_ms', 'steps_x', 'steps_y', 'pen_transitions', 'errors']
+EXACT = ['trace']
+# Printed only, host time depends on the machine
+INFORMATIONAL = ['host_ns_per_step']
+
+
+def build(directory, compiler):
+    binary = os.path.join(directory, 'sim')
+    command = [compiler, '-std=gnu99', '-O2', '-Wall', '-I' + os.path.join(BENCH, 'sim'), '-I' + MCU,
+               '-DJOB_STORE_BASE=((uintptr_t)simFlash)', '-DINFO_BASE=((uintptr_t)simInfo)',
+               '-o', binary] + SOURCES + ['-lm']
+    subprocess.check_call(command)
+    return binary
+
+
+def run(binary, workload, directory):
+    """Run workload in simulation, return its metrics."""
+    trace = os.path.join(directory, os.path.basename(workload) + '.trace')
+    env = dict(os.environ, SIM_WORKLOAD=workload, SIM_TRACE=trace)
+    process = subprocess.Popen([binary], env=env, stdout=subprocess.PIPE)
+    output = process.communicate()[0]
+    # Rejected commands end the run with code 4, their count is compared with the golden one
+    if process.returncode not in (0, 4):
+        raise Exception('simulation failed with code %d' % process.returncode)
+
+    metrics = {}
+    for line in output.splitlines():
+        key, value = line.split()
+        metrics[key] = float(value) if key in INFORMATIONAL else int(value)
+
+    with open(trace) as f:
+        metrics['trace'] = hashlib.sha1(f.read()).hexdigest()
+    return metrics
+
+
+def readGolden(path):
+    golden = {}
+    with open(path) as f:
+        for line in f:
+            key, value = line.split()
+            golden[key] = value if key in EXACT else int(value)
+    return golden
+
+
+def writeGolden(path, metrics):
+    with open(path, 'w') as f:
+        for key in LIMITED + EXACT:
+            f.write('%s %s\n' % (key, metrics[key]))
+
+
+def compare(metrics, golden):
+    """Return list of regressions and list of improvements."""
+    worse, better = [], []
+    for key in LIMITED:
+        if metrics[key] > golden[key]:
+            worse.append('%s %d -> %d' % (key, golden[key], metrics[key]))
+        elif metrics[key] < golden[key]:
+            better.append('%s %d -> %d' % (key, golden[key], metrics[key]))
+    for key in EXACT:
+        if metrics[key] != golden[key]:
+            worse.append('%s differs' % key)
+    return worse, better
+
+
+# Generated workloads, same seed gives the same commands
+
+def commandsText(title, commands):
+    lines = ['# ' + title]
+    for id, params in commands:
+        lines.append(' '.join([id] + list(params)))
+    return '\n'.join(lines) + '\n'
+
+
+def lineStress(rng):
+    # Short lines in random directions, starts jump around the area
+    shapes = []
+    for i in range(300):
+        x, y = rng.randint(10, 170), rng.randint(10, 170)
+        shapes.append(Line((x, y), (x + rng.randint(-10, 10), y + rng.randint(-10, 10))))
+    return shapes
+
+
+def circleStress(rng):
+    return [Circle((rng.randint(40, 140), rng.randint(40, 140)), rng.randint(1, 30)) for i in range(60)]
+
+
+def polylineStress(rng):
+    shapes = []
+    for i in range(20):
+        points = [(rng.randint(10, 170), rng.randint(10, 170)) for j in range(rng.randint(3, 40))]
+        shapes.append(Polyline(points, rng.random() < 0.5))
+    return shapes
+
+
+def bezierStress(rng):
+    shapes = []
+    for i in range(40):
+        shapes.append(Bezier([(rng.randint(10, 170), rng.randint(10, 170)) for j in range(4)]))
+        shapes.append(Arc((90, 90), rng.randint(5, 70), rng.randint(0, 359), rng.randint(0, 359)))
+    return shapes
+
+
+def readDxfEntities(path):
+    """Lines, circles and arcs of DXF file, enough for drawings without ezdxf."""
+    with open(path) as f:
+        codes = [line.strip() for line in f]
+    pairs = zip(codes[0::2], codes[1::2])
+
+    shapes = []
+    entity, values, inEntities = None, {}, False
+
+    def flush():
+        if entity == 'LINE':
+            shapes.append(Line((values['10'], values['20']), (values['11'], values['21'])))
+        elif entity == 'CIRCLE':
+            shapes.append(Circle((values['10'], values['20']), values['40']))
+        elif entity == 'ARC':
+            shapes.append(Arc((values['10'], values['20']), values['40'], values['50'], values['51']))
+
+    for code, value in pairs:
+        if code == '2' and value == 'ENTITIES':
+            inEntities = True
+        elif code == '0':
+            if inEntities:
+                flush()
+            if value == 'ENDSEC':
+                inEntities = False
+            entity, values = value, {}
+        elif code in ('10', '20', '11', '21', '40', '50', '51'):
+            values[code] = float(value)
+    return shapes
+
+
+def drawing(rng):
+    path = os.path.join(PC, 'Drawing2.dxf')
+    try:
+        from dxf_input import DxfInput
+        shapes = DxfInput(path).getShapes()
+    except ImportError:
+        shapes = readDxfEntities(path)
+    # Drawing is small, repeat it over the area
+    return [shape.translate(dx, dy) for dx in (10, 70, 130) for dy in (10, 70, 130) for shape in shapes]
+
+
+GENERATED = [
+    ('lines', 'Short lines scattered over the area', lineStress),
+    ('circles', 'Circles of various sizes', circleStress),
+    ('polylines', 'Open and closed polylines', polylineStress),
+    ('curves', 'Bezier curves and arcs', bezierStress),
+    ('drawing2', 'PC/Drawing2.dxf repeated 3x3', drawing),
+]
+
+
+def generate():
+    for name, title, function in GENERATED:
+        commands = shapesToCommands(function(random.Random(name)))
+        with open(os.path.join(WORKLOADS, name + '.txt'), 'w') as f:
+            f.write(commandsText(title, commands))
+        print 'Generated %s, %d commands' % (name, len(commands))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run firmware in simulation on fixed workloads and compare '
+                                                 'step traces and metrics with golden files.')
+    parser.add_argument('workloads', nargs='*', help='names of workloads, all when none is given')
+    parser.add_argument('-u', '--update', action='store_true', help='write current results as golden')
+    parser.add_argument('-g', '--generate', action='store_true', help='generate workloads again')
+    parser.add_argument('-k', '--keep', metavar='DIR', help='keep step traces in this directory')
+    parser.add_argument('--cc', default='gcc', help='host C compiler')
+    args = parser.parse_args()
+
+    if args.generate:
+        generate()
+
+    names = args.workloads or sorted(os.path.splitext(os.path.basename(path))[0]
+                                     for path in glob.glob(os.path.join(WORKLOADS, '*.txt')))
+
+    directory = args.keep or tempfile.mkdtemp(prefix='bench')
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    failed = 0
+    try:
+        binary = build(directory, args.cc)
+        print '%-10s %9s %10s %8s %8s %4s %8s  %s' % ('workload', 'ticks', 'time [s]', 'steps x', 'steps y',
+                                                     'pen', 'ns/step', 'result')
+        for name in names:
+            golden = os.path.join(GOLDEN, name + '.golden')
+            try:
+                metrics = run(binary, os.path.join(WORKLOADS, name + '.txt'), directory)
+            except Exception, e:
+                print '%-10s %s' % (name, e)
+                failed += 1
+                continue
+
+            if args.update:
+                writeGolden(golden, metrics)
+                result = 'updated'
+            elif not os.path.exists(golden):
+                result = 'no golden'
+            else:
+                worse, better = compare(metrics, readGolden(golden))
+                if worse:
+                    failed += 1
+                    result = 'FAIL ' + ', '.join(worse)
+                elif better:
+                    result = 'better ' + ', '.join(better) + ', update golden'
+                else:
+                    result = 'ok'
+
+            print '%-10s %9d %10.1f %8d %8d %4d %8.1f  %s' % (
+                name, metrics['ticks'], metrics['time_ms'] / 1000.0, metrics['steps_x'], metrics['steps_y'],
+                metrics['pen_transitions'], metrics['host_ns_per_step'], result)
+    finally:
+        if not args.keep:
+            shutil.rmtree(directory)
+
+    if failed:
+        print '%d workload(s) FAILED' % failed
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,66 @@
+/*******************************************************************************
+   fitkitlib: Host replacement of the FITkit library for simulation of the
+   firmware. Ports are plain variables, the simulator watches them.
+*******************************************************************************/
+#ifndef _SIM_FITKITLIB_H_
+#define _SIM_FITKITLIB_H_
+
+#include <stdint.h>
+
+#define CMD_UNKNOWN 0
+#define USER_COMMAND 1
+
+extern volatile uint8_t P4IN, P4OUT, P4DIR, P4SEL;
+extern volatile uint8_t P6OUT, P6DIR, P6SEL;
+
+// Timer A
+extern volatile uint16_t CCR0, CCTL0, TACTL;
+#define TASSEL_1 0x0100
+#define MC_2 0x0020
+#define CCIE 0x0010
+#define TIMERA0_VECTOR 12
+
+// Status register, sleeping lets the simulated timer tick
+#define LPM0_bits 0x0010
+#define GIE 0x0008
+#define wakeup
+#define interrupt(vector) void
+void _BIS_SR(uint16_t bits);
+void _DINT(void);
+void _EINT(void);
+
+// Flash controller, job store and information memory live in host memory
+extern volatile uint16_t FCTL1, FCTL2, FCTL3;
+#define FWKEY 0xA500
+#define FSSEL_2 0x0080
+#define ERASE 0x0002
+#define WRT 0x0040
+#define LOCK 0x0010
+extern int16_t simFlash[];
+extern int16_t simInfo[];
+
+void initialize_hardware(void);
+void WDG_stop(void);
+void delay_ms(unsigned int ms);
+void set_led_d5(uint8_t on);
+void set_led_d6(uint8_t on);
+
+void term_send_str(char *str);
+void term_send_str_crlf(char *str);
+void term_send_crlf(void);
+void terminal_idle(void);
+
+int strcmp2(char *a, char *b);
+int strcmp3(char *a, char *b);
+int strcmp4(char *a, char *b);
+int strcmp5(char *a, char *b);
+int strcmp6(char *a, char *b);
+int strcmp7(char *a, char *b);
+int strcmp8(char *a, char *b);
+
+// Callbacks of the application
+unsigned char decode_user_cmd(char *cmd_ucase, char *cmd);
+void print_user_help(void);
+void fpga_initialized(void);
+
+#endif
@@ -0,0 +1,344 @@
+/*******************************************************************************
+   sim: Host simulation of the plotter around the unchanged firmware.
+   Commands of workload (SIM_WORKLOAD) are fed to decode_user_cmd the way
+   the host does, motor and pen ports are watched after every step and their
+   changes are written to trace (SIM_TRACE). Metrics are printed at the end.
+*******************************************************************************/
+#include <fitkitlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "job.h"
+
+// Same constants as in main.c
+#define DELAY 4
+#define QUEUE_SIZE 8
+#define TOGGLE_X_MASK 0x01
+#define TOGGLE_Y_MASK 0x02
+#define PEN_MASK 0x04
+
+// Travel between toggles and starting position of head, in half steps
+#define TRAVEL_X 4000
+#define TRAVEL_Y 3300
+#define START_X 700
+#define START_Y 500
+
+// Workload that does not finish in this many ticks is stuck
+#define TICK_LIMIT 50000000L
+
+volatile uint8_t P4IN = 0xFF, P4OUT, P4DIR, P4SEL;
+volatile uint8_t P6OUT, P6DIR, P6SEL;
+volatile uint16_t CCR0, CCTL0, TACTL;
+volatile uint16_t FCTL1, FCTL2, FCTL3;
+int16_t simFlash[JOB_SLOT_COUNT * JOB_SLOT_WORDS];
+int16_t simInfo[INFO_SEGMENT_SIZE / 2];
+
+void Timer_A(void);
+
+static const uint8_t phases[8] = {0x1, 0x5, 0x4, 0x6, 0x2, 0xA, 0x8, 0x9};
+
+static FILE *workload, *trace;
+static int verbose;
+
+// Mechanics
+static long posX = START_X, posY = START_Y;
+static int phaseX, phaseY;
+static uint8_t lastMotors, lastPen;
+
+// Metrics
+static long ticks, delays, stepsX, stepsY, penTransitions, errors;
+static int measuring;
+static clock_t cpuStart;
+
+// Host side of the protocol
+static int initialized, credit, inflight, seq, finished;
+// Device didn't know the last sent command
+static int unknown;
+static char line[256];
+static int pending;
+
+static int phaseIndex(uint8_t word)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        if (phases[i] == word)
+            return i;
+    return -1;
+}
+
+// Follow motor by the change of its phase, return signed half steps
+static int follow(int *phase, uint8_t word)
+{
+    int idx = phaseIndex(word), delta;
+
+    // Unpowered motor keeps its position
+    if (idx < 0)
+        return 0;
+
+    delta = (idx - *phase + 8) % 8;
+    *phase = idx;
+    if (delta == 4)
+    {
+        fprintf(stderr, "sim: motor skipped two steps at tick %ld\n", ticks);
+        exit(3);
+    }
+    return delta < 4 ? delta : delta - 8;
+}
+
+static void updateToggles(void)
+{
+    P4IN |= TOGGLE_X_MASK | TOGGLE_Y_MASK;
+    // Toggles pull the input low when pressed
+    if (posX <= 0 || posX >= TRAVEL_X)
+        P4IN &= ~TOGGLE_X_MASK;
+    if (posY <= 0 || posY >= TRAVEL_Y)
+        P4IN &= ~TOGGLE_Y_MASK;
+}
+
+// Called whenever the firmware could have written the ports
+static void sample(void)
+{
+    uint8_t motors = P6OUT, pen = P4OUT & PEN_MASK;
+    int dx, dy;
+
+    if (motors == lastMotors && pen == lastPen)
+        return;
+
+    dx = follow(&phaseX, motors & 0x0F);
+    dy = follow(&phaseY, (motors >> 4) & 0x0F);
+    posX += dx;
+    posY += dy;
+    updateToggles();
+
+    if (measuring)
+    {
+        stepsX += dx < 0 ? -dx : dx;
+        stepsY += dy < 0 ? -dy : dy;
+        if (pen != lastPen)
+            penTransitions++;
+        if (trace)
+            fprintf(trace, "%ld %ld %02X %d\n", ticks, delays, motors, pen != 0);
+    }
+
+    lastMotors = motors;
+    lastPen = pen;
+}
+
+static void finish(void)
+{
+    double seconds = (double)(clock() - cpuStart) / CLOCKS_PER_SEC;
+    long steps = stepsX + stepsY;
+
+    printf("ticks %ld\n", ticks);
+    printf("time_ms %ld\n", ticks * DELAY + delays);
+    printf("steps_x %ld\n", stepsX);
+    printf("steps_y %ld\n", stepsY);
+    printf("pen_transitions %ld\n", penTransitions);
+    printf("errors %ld\n", errors);
+    // Host time only, informational
+    printf("host_ns_per_step %.1f\n", steps ? seconds * 1e9 / steps : 0.0);
+
+    if (trace)
+        fclose(trace);
+    exit(errors ? 4 : 0);
+}
+
+/* fitkitlib */
+
+void initialize_hardware(void)
+{
+    char *path = getenv("SIM_WORKLOAD");
+
+    workload = path ? fopen(path, "r") : stdin;
+    if (workload == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    path = getenv("SIM_TRACE");
+    trace = path ? fopen(path, "w") : NULL;
+    verbose = getenv("SIM_VERBOSE") != NULL;
+    updateToggles();
+}
+
+void WDG_stop(void)
+{
+}
+
+void delay_ms(unsigned int ms)
+{
+    if (measuring)
+        delays += ms;
+    sample();
+}
+
+void set_led_d5(uint8_t on)
+{
+}
+
+void set_led_d6(uint8_t on)
+{
+}
+
+void _BIS_SR(uint16_t bits)
+{
+    sample();
+    if (bits & LPM0_bits)
+    {
+        // Sleeping CPU is woken up by the next tick
+        Timer_A();
+        if (measuring && ++ticks > TICK_LIMIT)
+        {
+            fprintf(stderr, "sim: tick limit reached\n");
+            exit(2);
+        }
+    }
+}
+
+void _DINT(void)
+{
+}
+
+void _EINT(void)
+{
+}
+
+// Events of the firmware drive the host side of the protocol
+static void event(char *str)
+{
+    unsigned a, b;
+
+    if (sscanf(str, "!INITIALIZED %u", &a) == 1)
+    {
+        initialized = 1;
+        credit = a;
+        // Boot homing is not a part of the workload
+        measuring = 1;
+        cpuStart = clock();
+    }
+    else if (sscanf(str, "!ACCEPTED %u %u", &a, &b) == 2)
+        credit = b;
+    else if (sscanf(str, "!CREDIT %u", &a) == 1)
+        credit = a;
+    else if (sscanf(str, "!FINISHED %u", &a) == 1)
+    {
+        inflight--;
+        finished++;
+    }
+    else if (strncmp(str, "!ERROR", 6) == 0)
+    {
+        // Rejected command was never accepted, its credit is back
+        inflight--;
+        credit++;
+        errors++;
+        if (strstr(str, ":Unknown command."))
+            unknown = 1;
+        fprintf(stderr, "sim: %s\n", str);
+    }
+}
+
+void term_send_str(char *str)
+{
+    if (verbose)
+        fputs(str, stderr);
+}
+
+void term_send_str_crlf(char *str)
+{
+    if (verbose)
+        fprintf(stderr, "%s\n", str);
+    event(str);
+    sample();
+}
+
+void term_send_crlf(void)
+{
+    term_send_str_crlf("");
+}
+
+static int isDrawingCommand(char *cmd)
+{
+    static const char *names[] = {"LINE ", "CIRCLE ", "CUT ", "POLYLINE ", "VERTEX ", "POLYEND", "BEZIER ", "FEED ",
+                                  NULL};
+    int i;
+
+    for (i = 0; names[i]; i++)
+        if (strncasecmp(cmd, names[i], strlen(names[i])) == 0)
+            return 1;
+    return 0;
+}
+
+// Read next command of workload, skip comments and empty lines
+static int readCommand(void)
+{
+    char *end;
+
+    while (fgets(line, sizeof(line), workload))
+    {
+        end = line + strlen(line);
+        while (end > line && isspace((unsigned char)end[-1]))
+            *--end = 0;
+        if (line[0] && line[0] != '#')
+            return 1;
+    }
+    return 0;
+}
+
+void terminal_idle(void)
+{
+    char cmd[300], ucase[300];
+    int i;
+
+    sample();
+    if (!initialized)
+        return;
+
+    if (!pending)
+    {
+        pending = readCommand();
+        if (!pending)
+        {
+            if (inflight == 0)
+                finish();
+            return;
+        }
+    }
+
+    // Drawing commands are streamed while there is space for them,
+    // others wait until everything before them is finished
+    if (isDrawingCommand(line) ? credit == 0 : inflight > 0)
+        return;
+
+    snprintf(cmd, sizeof(cmd), "@%d %s", ++seq, line);
+    for (i = 0; cmd[i]; i++)
+        ucase[i] = toupper((unsigned char)cmd[i]);
+    ucase[i] = 0;
+
+    pending = 0;
+    inflight++;
+    credit--;
+    unknown = 0;
+    // Rejected arguments are only counted, a workload with unknown command is broken
+    decode_user_cmd(ucase, cmd);
+    if (unknown)
+    {
+        fprintf(stderr, "sim: unknown command %s\n", line);
+        exit(1);
+    }
+}
+
+static int strcmpN(char *a, char *b, int n)
+{
+    return strncmp(a, b, n) == 0;
+}
+
+int strcmp2(char *a, char *b) { return strcmpN(a, b, 2); }
+int strcmp3(char *a, char *b) { return strcmpN(a, b, 3); }
+int strcmp4(char *a, char *b) { return strcmpN(a, b, 4); }
+int strcmp5(char *a, char *b) { return strcmpN(a, b, 5); }
+int strcmp6(char *a, char *b) { return strcmpN(a, b, 6); }
+int strcmp7(char *a, char *b) { return strcmpN(a, b, 7); }
+int strcmp8(char *a, char *b) { return strcmpN(a, b, 8); }
@@ -1,16 +1,13 @@
-#define DEMO_LINE 0
-#define DEMO_CIRCLE 1
-#define DEMO_CUT 2
-#define DEMO_END 3
+#include "job.h"
 
-int32_t demo[] = {DEMO_CIRCLE, 250, 250, 150,
-                  DEMO_CIRCLE, 450, 250, 150,
-				  DEMO_CIRCLE, 650, 250, 150,
-				  DEMO_CIRCLE, 350, 450, 150,
-				  DEMO_CIRCLE, 550, 450, 150,
-				  DEMO_LINE, 250, 250, 250, 250,
-				  DEMO_CUT, 350, 450,
-                  DEMO_CUT, 450, 250,
-				  DEMO_CUT, 550, 450,
-				  DEMO_CUT, 650, 250,
-				  DEMO_END};
+const int16_t demo[] = {JOB_CIRCLE, 250, 250, 150, 0,
+                        JOB_CIRCLE, 450, 250, 150, 0,
+                        JOB_CIRCLE, 650, 250, 150, 0,
+                        JOB_CIRCLE, 350, 450, 150, 0,
+                        JOB_CIRCLE, 550, 450, 150, 0,
+                        JOB_LINE, 250, 250, 250, 250,
+                        JOB_CUT, 350, 450,
+                        JOB_CUT, 450, 250,
+                        JOB_CUT, 550, 450,
+                        JOB_CUT, 650, 250,
+                        JOB_END};
@@ -48,8 +48,9 @@ void Hilbert_d2xy(int32_t n, int32_t d, int32_t *x, int32_t *y) {
 }
 // </Copyright>
 
-// Log2(x), if not integer, lower controls whether lower or higher result is returned
-int32_t log2(int32_t x, uint8_t lower)
+// Log2(x), if not integer, lower controls whether lower or higher result is returned.
+// Named apart from log2 of math library, it has different arguments.
+int32_t ilog2(int32_t x, uint8_t lower)
 {
     if (x <= 0)
         return -1;
@@ -101,7 +102,7 @@ int32_t Hilbert_r2n(int32_t r)
 // convert number of tiles in dimension (n) to recursion number (r)
 int32_t Hilbert_n2r(int32_t n)
 {
-    return log2(n, 1);
+    return ilog2(n, 1);
 }
 
 // Image size from number of tiles and step size
@@ -0,0 +1,105 @@
+/*******************************************************************************
+   job: Storage of compiled jobs in internal flash.
+   Author(s): Ivan Sevcik <xsevci50 AT stud.fit.vutbr.cz>
+*******************************************************************************/
+#include <fitkitlib.h>
+#include "job.h"
+
+// Flash timing generator has to run at 257-476 kHz, SMCLK is 7.3728 MHz
+#define FLASH_CLOCK_DIVIDER 20
+
+const uint8_t jobArgCount[JOB_OPCODE_COUNT] = {4, 4, 2, 0, 2, 2, 0, 8, 1};
+
+#ifndef JOB_STORE_BASE
+// Store is a part of the program image, so the linker places the program
+// around it and fails when both don't fit into flash. Erased flash reads
+// as -1, slots start on segment boundary so erasing them touches nothing else.
+// Volatile, flash is rewritten behind the compiler's back.
+// Simulation defines JOB_STORE_BASE with a store of its own.
+const volatile int16_t jobStore[JOB_SLOT_COUNT * JOB_SLOT_WORDS] __attribute__((aligned(JOB_SEGMENT_SIZE))) =
+    {[0 ... JOB_SLOT_COUNT * JOB_SLOT_WORDS - 1] = -1};
+#define JOB_STORE_BASE ((uintptr_t)jobStore)
+#endif
+
+// returns address of slot
+int16_t* Job_slot(uint8_t slot)
+{
+    return (int16_t*)(JOB_STORE_BASE + (uint16_t)slot * JOB_SLOT_SIZE);
+}
+
+// returns true if slot holds complete job
+uint8_t Job_valid(uint8_t slot)
+{
+    return slot < JOB_SLOT_COUNT && Job_slot(slot)[0] == JOB_MAGIC;
+}
+
+// erase consecutive flash segments of given size
+static void eraseSegments(int16_t *segment, uint8_t count, uint16_t size)
+{
+    uint8_t i;
+
+    // Flash can't be read while being erased, nor can the interrupt vectors
+    _DINT();
+    FCTL2 = FWKEY + FSSEL_2 + (FLASH_CLOCK_DIVIDER - 1);
+    FCTL3 = FWKEY;
+    for (i = 0; i < count; i++)
+    {
+        FCTL1 = FWKEY + ERASE;
+        // Dummy write starts erasing of the segment
+        *segment = 0;
+        segment += size / 2;
+    }
+    FCTL1 = FWKEY;
+    FCTL3 = FWKEY + LOCK;
+    _EINT();
+}
+
+// write one word into erased flash
+static void writeWord(int16_t *address, int16_t value)
+{
+    _DINT();
+    FCTL2 = FWKEY + FSSEL_2 + (FLASH_CLOCK_DIVIDER - 1);
+    FCTL3 = FWKEY;
+    FCTL1 = FWKEY + WRT;
+    *address = value;
+    FCTL1 = FWKEY;
+    FCTL3 = FWKEY + LOCK;
+    _EINT();
+}
+
+// erase whole slot
+void Job_erase(uint8_t slot)
+{
+    eraseSegments(Job_slot(slot), JOB_SLOT_SEGMENTS, JOB_SEGMENT_SIZE);
+}
+
+// write one word into slot
+void Job_write(uint8_t slot, uint16_t idx, int16_t value)
+{
+    writeWord(Job_slot(slot) + idx, value);
+}
+
+// returns calibrated travel, false if none is saved
+uint8_t Info_loadTravel(int32_t *travelX, int32_t *travelY)
+{
+    const int16_t *info = (const int16_t*)INFO_BASE;
+
+    if (info[0] != INFO_MAGIC)
+        return 0;
+
+    *travelX = info[1];
+    *travelY = info[2];
+    return 1;
+}
+
+// save calibrated travel, it survives reset
+void Info_saveTravel(int32_t travelX, int32_t travelY)
+{
+    int16_t *info = (int16_t*)INFO_BASE;
+
+    eraseSegments(info, 1, INFO_SEGMENT_SIZE);
+    writeWord(info + 1, (int16_t)travelX);
+    writeWord(info + 2, (int16_t)travelY);
+    // Travel becomes valid only when it is complete
+    writeWord(info, INFO_MAGIC);
+}
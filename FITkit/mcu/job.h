@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+// Operations of compiled job, each is followed by its arguments
+// in internal steps, JOB_CIRCLE ends with octant it starts in,
+// JOB_FEED sets feed rate in mm/s for the following operations.
+// Job is terminated by JOB_END.
+#define JOB_LINE 0
+#define JOB_CIRCLE 1
+#define JOB_CUT 2
+#define JOB_END 3
+#define JOB_POLYLINE 4
+#define JOB_VERTEX 5
+#define JOB_POLYEND 6
+#define JOB_BEZIER 7
+#define JOB_FEED 8
+#define JOB_OPCODE_COUNT 9
+#define JOB_MAX_ARGS 8
+
+// Number of arguments of each operation
+extern const uint8_t jobArgCount[JOB_OPCODE_COUNT];
+
+// Jobs are stored in slots of internal flash reserved in the program image,
+// first word of valid slot is JOB_MAGIC and the job follows.
+#define JOB_SLOT_COUNT 4
+#define JOB_SLOT_SEGMENTS 4
+#define JOB_SEGMENT_SIZE 512
+#define JOB_SLOT_SIZE (JOB_SLOT_SEGMENTS * JOB_SEGMENT_SIZE)
+#define JOB_SLOT_WORDS (JOB_SLOT_SIZE / 2)
+#define JOB_MAGIC 0x4A42
+
+// Calibrated travel is kept in information memory segment A,
+// first word is INFO_MAGIC and travel in internal steps follows.
+// Simulation provides its own memory.
+#ifndef INFO_BASE
+#define INFO_BASE 0x1080
+#endif
+#define INFO_SEGMENT_SIZE 128
+#define INFO_MAGIC 0x5452
+
+// returns address of slot
+int16_t* Job_slot(uint8_t slot);
+// returns true if slot holds complete job
+uint8_t Job_valid(uint8_t slot);
+// erase whole slot
+void Job_erase(uint8_t slot);
+// write one word into slot
+void Job_write(uint8_t slot, uint16_t idx, int16_t value);
+// returns calibrated travel, false if none is saved
+uint8_t Info_loadTravel(int32_t *travelX, int32_t *travelY);
+// save calibrated travel, it survives reset
+void Info_saveTravel(int32_t travelX, int32_t travelY);
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <float.h>
+#include "job.h"
 #include "demo.h"
 #include "hilbert.h"
 
@@ -42,6 +43,8 @@
 #define MOTOR_FORWARD 0
 #define MOTOR_BACKWARD 2
 #define MOTOR_DIR_MASK 2
+#define MOTOR_FULL_STEP 4
+#define MOTOR_IDLE 8
 
 #define IN_DRAWING_AREA 0
 #define BEFORE_DRAWING_AREA 1
@@ -55,6 +58,12 @@
 
 #define motorPhasesCount 8
 const uint8_t motorPhases[motorPhasesCount] = {0x1, 0x5, 0x4, 0x6, 0x2, 0xA, 0x8, 0x9};
+// Two-phase-on full steps, i-th phase equals to motorPhases[2*i + 1]
+#define motorFullPhasesCount 4
+const uint8_t motorFullPhases[motorFullPhasesCount] = {0x5, 0x6, 0xA, 0x9};
+
+#define STEP_MODE_HALF 0
+#define STEP_MODE_FULL 1
 
 #define STATE_FINISHED 0
 #define STATE_MOVING 1
@@ -63,9 +72,11 @@ const uint8_t motorPhases[motorPhasesCount] = {0x1, 0x5, 0x4, 0x6, 0x2, 0xA, 0x8
 #define DRAWING_FREE 0
 #define DRAWING_LINE 1
 #define DRAWING_CIRCLE 2
+#define DRAWING_POLYLINE 3
+#define DRAWING_BEZIER 4
 
 #define DRAWING_COMPLEX_FREE 0
-#define DRAWING_COMPLEX_DEMO 1
+#define DRAWING_COMPLEX_JOB 1
 #define DRAWING_COMPLEX_HILBERT 2
 
 #define OPERATION_IN_PROGRESS 0
@@ -77,6 +88,42 @@ const uint8_t motorPhases[motorPhasesCount] = {0x1, 0x5, 0x4, 0x6, 0x2, 0xA, 0x8
 #define DELAY 4
 #define IDLE_TIME 2000
 
+// Main loop runs in ticks of DELAY milliseconds measured by Timer A
+// from the 32768 Hz auxiliary clock, CPU sleeps between them.
+#define ACLK_FREQ 32768
+#define TICK_PERIOD ((uint16_t)((uint32_t)ACLK_FREQ * DELAY / 1000))
+
+// Homing seeks the toggles quickly, then backs off and approaches them
+// again slowly so the origin does not depend on the seek speed.
+#define HOME_SEEK_DELAY 1
+#define HOME_APPROACH_DELAY 8
+#define HOME_BACKOFF_STEPS 40
+// Distance from the far toggles kept by soft limits, in motor steps
+#define CALIBRATE_MARGIN_STEPS 10
+
+// Telemetry is off until host asks for it, interval is limited so it can't flood the link
+#define TELEMETRY_MIN_MS 100
+
+// Feed rate limits cutting to path length in FEED_UNITs of internal step per tick,
+// diagonal step is sqrt(2) times longer than a step of one axis
+#define FEED_UNIT 1024
+#define FEED_DIAGONAL 1448
+// Highest feed rate in mm/s, motors can't go faster than a step per tick anyway
+#define FEED_MAX 1000
+
+// Number of vertices that can be queued ahead of the drawn polyline segment
+#define POLYLINE_BUFFER_SIZE 16
+
+// Drawing commands wait in queue, so the host can send them ahead
+#define COMMAND_QUEUE_SIZE 8
+
+// Bezier curve is split into at most 2^BEZIER_MAX_LOG2 chords
+#define BEZIER_MAX_LOG2 8
+// Fractional bits of fixed point numbers used by forward differencing
+#define BEZIER_FRAC_BITS (3 * BEZIER_MAX_LOG2)
+// Allowed deviation of chords from the curve in internal steps
+#define BEZIER_TOLERANCE 1
+
 typedef struct LineContextStruct
 {
     int32_t x1, y1, x2, y2;
@@ -87,19 +134,56 @@ typedef struct LineContextStruct
 typedef struct CircleContextStruct
 {
     int32_t x, R, sx, sy, i, j;
+    // Point where the circle starts and ends
+    int32_t startX, startY;
+    // Number of octant boundaries left to cross
+    uint8_t octants;
     uint8_t state, xGrow;
 } CircleContext;
 
+typedef struct PolylineContextStruct
+{
+    // Currently drawn segment
+    LineContext lc;
+    // Ring buffer of vertices waiting to be drawn
+    int32_t vx[POLYLINE_BUFFER_SIZE], vy[POLYLINE_BUFFER_SIZE];
+    uint16_t vseq[POLYLINE_BUFFER_SIZE];
+    uint8_t first, count;
+    // No more vertices will arrive
+    uint8_t closed;
+    // Sequence number of command that created current segment
+    uint16_t seq;
+    // Finished segments are reported to host, report of current one is pending
+    uint8_t reporting, reportPending;
+    // Whole polyline is reported under its POLYEND, polyline without it is not
+    uint8_t reportEnd;
+} PolylineContext;
+
+typedef struct BezierContextStruct
+{
+    // Currently drawn chord
+    LineContext lc;
+    // Position and its forward differences in fixed point
+    int64_t x, y, dx1, dy1, dx2, dy2, dx3, dy3;
+    // Number of remaining chords
+    uint16_t segments;
+} BezierContext;
+
 typedef union DrawingContextUnion
 {
     LineContext lc;
     CircleContext cc;
+    PolylineContext pc;
+    BezierContext bc;
 } DrawingContext;
 
-typedef struct DemoContextStruct
+typedef struct JobContextStruct
 {
-    int32_t idx;
-} DemoContext;
+    const int16_t *program;
+    uint16_t idx;
+    // Feed rate set by host, job may change it only until it ends
+    uint16_t feedRate;
+} JobContext;
 
 typedef struct HilbertContextStruct
 {
@@ -111,10 +195,17 @@ typedef struct HilbertContextStruct
 
 typedef union ComplexDrawingContextUnion
 {
-    DemoContext dc;
+    JobContext jc;
     HilbertContext hc;
 } ComplexDrawingContext;
 
+typedef struct QueuedCommandStruct
+{
+    uint16_t seq;
+    uint8_t op;
+    int16_t args[JOB_MAX_ARGS];
+} QueuedCommand;
+
 // Internal head position used by algorithms
 int32_t internalHeadX = 0;
 int32_t internalHeadY = 0;
@@ -126,6 +217,49 @@ uint8_t headXArea = IN_DRAWING_AREA;
 uint8_t headYArea = IN_DRAWING_AREA;
 // State of pen
 uint8_t penState = PEN_UP;
+// Stepping used for moves with pen up and for drawing
+uint8_t stepModeMove = STEP_MODE_FULL;
+uint8_t stepModeDraw = STEP_MODE_HALF;
+// Cutting speed in mm/s, with 0 the pen makes a step every tick in any direction
+uint16_t feedRate = 0;
+// Path length earned each tick and left to cut, in FEED_UNITs
+int32_t feedPerTick = 0;
+int32_t feedBudget = 0;
+// Soft limits of head position in internal steps, valid after calibration
+uint8_t calibrated = 0;
+int32_t travelX = 0;
+int32_t travelY = 0;
+
+// Drawing commands are compiled into job slot instead of being drawn,
+// job that didn't fit refuses the rest of its commands until ENDSTORE
+#define STORE_OFF 0
+#define STORE_WRITING 1
+#define STORE_FAILED 2
+uint8_t storing = STORE_OFF;
+uint8_t storeSlot = 0;
+uint16_t storeIdx = 0;
+
+// CUT or VERTEX was refused, the rest of its path is refused too until a new path
+// starts, it would go from the wrong point
+uint8_t pathBroken = 0;
+
+// Queue of drawing commands received ahead
+QueuedCommand commandQueue[COMMAND_QUEUE_SIZE];
+uint8_t queueFirst = 0;
+uint8_t queueCount = 0;
+uint8_t creditChanged = 0;
+// Sequence numbers of currently decoded command, running operation and complex drawing
+uint16_t commandSeq = 0;
+uint16_t runningSeq = 0;
+uint16_t complexSeq = 0;
+
+// Number of elapsed ticks
+volatile uint32_t ticks = 0;
+volatile uint8_t tickElapsed = 0;
+
+// Ticks between telemetry frames, 0 when off, and tick of the next frame
+uint16_t telemetryInterval = 0;
+uint32_t nextTelemetry = 0;
 
 uint8_t currentDrawing = DRAWING_FREE;
 DrawingContext currentContext;
@@ -190,6 +324,24 @@ int32_t internalToRealStep(int32_t internal, double constant)
     return (int32_t)((double)internal * INTERNAL_STEP_MM / constant);
 }
 
+int32_t realToInternalStep(int32_t real, double constant)
+{
+    return (int32_t)((double)real * constant / INTERNAL_STEP_MM);
+}
+
+void sendError(char *text);
+
+// Return true if the rectangle is reachable, otherwise report the error.
+// Anything is accepted until the travel is calibrated.
+uint8_t checkTravelRange(int32_t minX, int32_t minY, int32_t maxX, int32_t maxY)
+{
+    if (!calibrated || (minX >= 0 && minY >= 0 && maxX <= travelX && maxY <= travelY))
+        return 1;
+
+    sendError("Outside of travel range.");
+    return 0;
+}
+
 /*******************************************************************************
  * Vypis uzivatelske napovedy (funkce se vola pri vykonavani prikazu "help")
  * systemoveho helpu
@@ -202,18 +354,145 @@ void print_user_help(void)
 char print_buffer[PRINT_BUFFER_SIZE];
 void print_val1(char *info, int32_t v1)
 {
-    snprintf(print_buffer, PRINT_BUFFER_SIZE, "%s %ld", info, v1);
+    snprintf(print_buffer, PRINT_BUFFER_SIZE, "%s %ld", info, (long)v1);
     term_send_str_crlf(print_buffer);
 }
 
 void print_val2(char *info, int32_t v1, int32_t v2)
 {
-    snprintf(print_buffer, PRINT_BUFFER_SIZE, "%s %ld %ld", info, v1, v2);
+    snprintf(print_buffer, PRINT_BUFFER_SIZE, "%s %ld %ld", info, (long)v1, (long)v2);
     term_send_str_crlf(print_buffer);
 }
 
+// Events for host carry sequence number of the command they belong to
+void sendEvent(char *event, uint16_t seq)
+{
+    snprintf(print_buffer, PRINT_BUFFER_SIZE, "!%s %u", event, (unsigned)seq);
+    term_send_str_crlf(print_buffer);
+}
+
+void sendError(char *text)
+{
+    snprintf(print_buffer, PRINT_BUFFER_SIZE, "!ERROR %u :%s", (unsigned)commandSeq, text);
+    term_send_str_crlf(print_buffer);
+}
+
+// Accepted command also tells how many more commands can be queued
+void sendAccepted()
+{
+    snprintf(print_buffer, PRINT_BUFFER_SIZE, "!ACCEPTED %u %u", (unsigned)commandSeq,
+             (unsigned)(COMMAND_QUEUE_SIZE - queueCount));
+    term_send_str_crlf(print_buffer);
+}
+
+// Drawn command has already put pen down on its path, it is not just moving to its start
+uint8_t drawingCutting()
+{
+    switch (currentDrawing)
+    {
+        case DRAWING_LINE:
+            return currentContext.lc.state != STATE_MOVING;
+        case DRAWING_CIRCLE:
+            return currentContext.cc.state != STATE_MOVING;
+        case DRAWING_POLYLINE:
+            return currentContext.pc.lc.state != STATE_MOVING;
+        case DRAWING_BEZIER:
+            return currentContext.bc.lc.state != STATE_MOVING;
+        default:
+            return 0;
+    }
+}
+
+// Position of head in internal steps and whether the drawn command was cutting,
+// host resumes interrupted drawing from it
+void sendPosition(uint8_t cutting)
+{
+    snprintf(print_buffer, PRINT_BUFFER_SIZE, "!POSITION %u %ld %ld %u", (unsigned)commandSeq,
+             (long)internalHeadX, (long)internalHeadY, (unsigned)cutting);
+    term_send_str_crlf(print_buffer);
+}
+
+// Head position, sequence number of drawn command or segment and queue fill
+void sendTelemetry()
+{
+    uint16_t seq = runningSeq;
+
+    if (currentComplexDrawing != DRAWING_COMPLEX_FREE)
+        seq = complexSeq;
+    else if (currentDrawing == DRAWING_POLYLINE)
+        seq = currentContext.pc.seq;
+
+    snprintf(print_buffer, PRINT_BUFFER_SIZE, "!TELEMETRY %u %ld %ld %u", (unsigned)seq,
+             (long)internalHeadX, (long)internalHeadY, (unsigned)queueCount);
+    term_send_str_crlf(print_buffer);
+}
+
+void sendCredit()
+{
+    snprintf(print_buffer, PRINT_BUFFER_SIZE, "!CREDIT %u", (unsigned)(COMMAND_QUEUE_SIZE - queueCount));
+    term_send_str_crlf(print_buffer);
+}
+
+// Parse exactly count space separated integer arguments into val.
+// Return 1 on success, otherwise report the error and return 0.
+uint8_t parseArguments(char *args, int32_t *val, uint8_t count)
+{
+    char *arg, *endptr;
+    uint8_t argc = 0;
+
+    arg = strtok(args, " ");
+    while (arg != NULL)
+    {
+        if (argc >= count)
+        {
+            sendError("Too many arguments.");
+            return 0;
+        }
+
+        val[argc] = strtol(arg, &endptr, 10);
+        if ((endptr - arg) != strlen(arg))
+        {
+            // Argument wasn't fully converted - error
+            sendError("Error at argument.");
+            return 0;
+        }
+
+        argc++;
+        arg = strtok(NULL, " ");
+    }
+
+    if (argc != count)
+    {
+        sendError("Too few arguments.");
+        return 0;
+    }
+
+    return 1;
+}
+
+void moveToOrigin();
+void calibrate();
+void penUp();
+void setFeedRate(int32_t rate);
 void drawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2);
-void drawCircle (int32_t sx, int32_t sy, int32_t R);
+void drawCircle (int32_t sx, int32_t sy, int32_t R, uint8_t octant);
+void drawPolyline (int32_t x, int32_t y);
+uint8_t addPolylineVertex (int32_t x, int32_t y, uint16_t seq);
+void endPolyline (uint16_t seq);
+void drawBezier (int32_t *p);
+void feedPolyline(JobContext* jc);
+void submitOperation(uint8_t op, int32_t *args);
+uint32_t getTicks();
+
+// Return true if anything is drawn or waits in queue, report it as error
+uint8_t checkBusy()
+{
+    if (currentDrawing == DRAWING_FREE && currentComplexDrawing == DRAWING_COMPLEX_FREE && queueCount == 0)
+        return 0;
+
+    sendError("Device is busy.");
+    return 1;
+}
 
 /*******************************************************************************
  * Dekodovani a vykonani uzivatelskych prikazu
@@ -222,19 +501,96 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
 {
     char *args, *arg, *endptr;
     uint8_t argc;
-    int32_t val[4];
+    int32_t val[8];
     
+    // Optional sequence number of the command, "@<seq> <command>"
+    commandSeq = 0;
+    if (cmd[0] == '@')
+    {
+        commandSeq = strtol(cmd + 1, &endptr, 10);
+        while (*endptr == ' ')
+            endptr++;
+        cmd_ucase += endptr - cmd;
+        cmd = endptr;
+    }
+
     if (strcmp4(cmd_ucase, "STOP"))
     {
+        uint8_t cutting = drawingCutting();
+
+        if (currentComplexDrawing == DRAWING_COMPLEX_JOB)
+            setFeedRate(currentComplexContext.jc.feedRate);
         currentDrawing = DRAWING_FREE;
         currentComplexDrawing = DRAWING_COMPLEX_FREE;
+        storing = STORE_OFF;
+        pathBroken = 0;
+        queueCount = 0;
+        sendAccepted();
+        sendPosition(cutting);
+        sendEvent("FINISHED", commandSeq);
+        return USER_COMMAND;
     }   
+
+    if (strcmp5(cmd_ucase, "WHERE"))
+    {
+        sendAccepted();
+        sendPosition(drawingCutting());
+        sendEvent("FINISHED", commandSeq);
+        return USER_COMMAND;
+    }
     
-    if (currentDrawing != DRAWING_FREE || currentComplexDrawing != DRAWING_COMPLEX_FREE)
+    if (storing)
     {
-        term_send_str_crlf("Error: Device have not yet finished operation");
+        if (strncmp(cmd_ucase, "ENDSTORE", 8) == 0)
+        {
+            if (storing == STORE_FAILED)
+            {
+                // Slot stays invalid, host gets the end of the job rejected too
+                storing = STORE_OFF;
+                sendError("Job does not fit into slot.");
+                return USER_COMMAND;
+            }
+
+            Job_write(storeSlot, storeIdx++, JOB_END);
+            // Job becomes valid only when it is complete
+            Job_write(storeSlot, 0, JOB_MAGIC);
+            storing = STORE_OFF;
+            print_val1("Job stored, words:", storeIdx);
+            sendAccepted();
+            sendEvent("FINISHED", commandSeq);
+            return USER_COMMAND;
+        }
+
+        // Only drawing commands and feed rate can be stored
+        if (!(strcmp5(cmd_ucase, "LINE ") || strcmp7(cmd_ucase, "CIRCLE ") || strcmp4(cmd_ucase, "CUT ") ||
+              strcmp8(cmd_ucase, "POLYLINE") || strcmp7(cmd_ucase, "VERTEX ") || strcmp7(cmd_ucase, "POLYEND") ||
+              strcmp7(cmd_ucase, "BEZIER ") || strcmp5(cmd_ucase, "FEED ")))
+        {
+            sendError("Device is storing a job.");
+            return USER_COMMAND;
+        }
+
+        if (storing == STORE_FAILED)
+        {
+            // Rest of the job must not be drawn instead of stored
+            sendError("Job does not fit into slot.");
+            return USER_COMMAND;
+        }
+    }
+
+    if (pathBroken)
+    {
+        if (strcmp4(cmd_ucase, "CUT ") || strcmp7(cmd_ucase, "VERTEX "))
+        {
+            sendError("Path is broken.");
+            return USER_COMMAND;
+        }
+        // Polyline is closed by its POLYEND, other drawings start where they say
+        if (strcmp5(cmd_ucase, "LINE ") || strcmp7(cmd_ucase, "CIRCLE ") || strcmp8(cmd_ucase, "POLYLINE") ||
+            strcmp7(cmd_ucase, "POLYEND") || strcmp7(cmd_ucase, "BEZIER "))
+            pathBroken = 0;
     }
-  
+
     if (strcmp5(cmd_ucase, "LINE ")) 
     {
         // Move to arguments part
@@ -259,7 +615,7 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
                 val[3] = mmToInternalStep(strtol(arg, &endptr, 10));
                 break;
             default:
-                term_send_str_crlf("Too many arguments.");
+                sendError("Too many arguments.");
                 return CMD_UNKNOWN;
             }
             argc++;
@@ -267,7 +623,7 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
             if ((endptr - arg) != strlen(arg))
             {
                 // Argument wasn't fully converted - error
-                term_send_str_crlf("Error at argument.");
+                sendError("Error at argument.");
                 return CMD_UNKNOWN;
             }
             
@@ -276,12 +632,15 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
         
         if (argc != 4)
         {
-            term_send_str_crlf("Too few arguments.");
+            sendError("Too few arguments.");
+            return CMD_UNKNOWN;
         }
     
+        if (!checkTravelRange(val[0] < val[2] ? val[0] : val[2], val[1] < val[3] ? val[1] : val[3],
+                              val[0] > val[2] ? val[0] : val[2], val[1] > val[3] ? val[1] : val[3]))
+            return USER_COMMAND;
     
-        term_send_str_crlf("Drawing started.");
-        drawLine(val[0], val[1], val[2], val[3]);
+        submitOperation(JOB_LINE, val);
     } 
     else if (strcmp7(cmd_ucase, "CIRCLE ")) 
     {
@@ -303,8 +662,12 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
             case 2:
                 val[2] = mmToInternalStep(strtol(arg, &endptr, 10));
                 break;
+            case 3:
+                // Optional octant to start in, clockwise from the top
+                val[3] = strtol(arg, &endptr, 10);
+                break;
             default:
-                term_send_str_crlf("Too many arguments.");
+                sendError("Too many arguments.");
                 return CMD_UNKNOWN;
             }
             argc++;
@@ -312,20 +675,31 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
             if ((endptr - arg) != strlen(arg))
             {
                 // Argument wasn't fully converted - error
-                term_send_str_crlf("Error at argument.");
+                sendError("Error at argument.");
                 return CMD_UNKNOWN;
             }
             
             arg = strtok(NULL, " ");
         }
         
-        if (argc != 3)
+        if (argc < 3)
         {
-            term_send_str_crlf("Too few arguments.");
+            sendError("Too few arguments.");
+            return CMD_UNKNOWN;
+        }
+
+        if (argc == 3)
+            val[3] = 0;
+        else if (val[3] < 0 || val[3] > 7)
+        {
+            sendError("Error at argument.");
+            return CMD_UNKNOWN;
         }
     
-        term_send_str_crlf("Drawing started.");
-        drawCircle(val[0], val[1], val[2]);
+        if (!checkTravelRange(val[0] - val[2], val[1] - val[2], val[0] + val[2], val[1] + val[2]))
+            return USER_COMMAND;
+
+        submitOperation(JOB_CIRCLE, val);
     }
     else if (strcmp4(cmd_ucase, "CUT ")) 
     {
@@ -345,7 +719,7 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
                 val[1] = mmToInternalStep(strtol(arg, &endptr, 10));
                 break;
             default:
-                term_send_str_crlf("Too many arguments.");
+                sendError("Too many arguments.");
                 return CMD_UNKNOWN;
             }
             argc++;
@@ -353,7 +727,7 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
             if ((endptr - arg) != strlen(arg))
             {
                 // Argument wasn't fully converted - error
-                term_send_str_crlf("Error at argument.");
+                sendError("Error at argument.");
                 return CMD_UNKNOWN;
             }
             
@@ -362,20 +736,210 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
         
         if (argc != 2)
         {
-            term_send_str_crlf("Too few arguments.");
+            sendError("Too few arguments.");
+            return CMD_UNKNOWN;
         }
     
+        if (!checkTravelRange(val[0], val[1], val[0], val[1]))
+        {
+            pathBroken = 1;
+            return USER_COMMAND;
+        }
     
-        term_send_str_crlf("Drawing started.");
-        drawLine(internalHeadX, internalHeadY, val[0], val[1]);
+        submitOperation(JOB_CUT, val);
+    }
+    else if (strcmp8(cmd_ucase, "POLYLINE"))
+    {
+        if (!parseArguments(cmd + 8, val, 2))
+            return CMD_UNKNOWN;
+
+        val[0] = mmToInternalStep(val[0]);
+        val[1] = mmToInternalStep(val[1]);
+        if (!checkTravelRange(val[0], val[1], val[0], val[1]))
+            return USER_COMMAND;
+
+        submitOperation(JOB_POLYLINE, val);
+    }
+    else if (strcmp7(cmd_ucase, "VERTEX "))
+    {
+        if (!parseArguments(cmd + 7, val, 2))
+            return CMD_UNKNOWN;
+
+        val[0] = mmToInternalStep(val[0]);
+        val[1] = mmToInternalStep(val[1]);
+        if (!checkTravelRange(val[0], val[1], val[0], val[1]))
+        {
+            pathBroken = 1;
+            return USER_COMMAND;
+        }
+
+        submitOperation(JOB_VERTEX, val);
+    }
+    else if (strcmp7(cmd_ucase, "POLYEND"))
+    {
+        submitOperation(JOB_POLYEND, val);
+    }
+    else if (strcmp7(cmd_ucase, "BEZIER "))
+    {
+        if (!parseArguments(cmd + 7, val, 8))
+            return CMD_UNKNOWN;
+
+        for (argc = 0; argc < 8; argc++)
+            val[argc] = mmToInternalStep(val[argc]);
+
+        // Curve lies inside convex hull of its control points
+        int32_t minX = val[0], minY = val[1], maxX = val[0], maxY = val[1];
+        for (argc = 2; argc < 8; argc += 2)
+        {
+            if (val[argc] < minX) minX = val[argc];
+            if (val[argc] > maxX) maxX = val[argc];
+            if (val[argc + 1] < minY) minY = val[argc + 1];
+            if (val[argc + 1] > maxY) maxY = val[argc + 1];
+        }
+        if (!checkTravelRange(minX, minY, maxX, maxY))
+            return USER_COMMAND;
+
+        submitOperation(JOB_BEZIER, val);
+    }
+    else if (strcmp5(cmd_ucase, "FEED "))
+    {
+        // FEED <mm/s>, 0 turns the limit off; queued, so it applies to the commands that follow
+        if (!parseArguments(cmd + 5, val, 1))
+            return CMD_UNKNOWN;
+
+        if (val[0] < 0 || val[0] > FEED_MAX)
+        {
+            sendError("Error at argument.");
+            return CMD_UNKNOWN;
+        }
+
+        submitOperation(JOB_FEED, val);
+    }
+    else if (strcmp4(cmd_ucase, "HOME"))
+    {
+        if (checkBusy())
+            return USER_COMMAND;
+
+        sendAccepted();
+        sendEvent("STARTED", commandSeq);
+        penUp();
+        moveToOrigin();
+        sendEvent("FINISHED", commandSeq);
+    }
+    else if (strncmp(cmd_ucase, "STEPMODE ", 9) == 0)
+    {
+        // STEPMODE MOVE|DRAW FULL|HALF
+        uint8_t *mode;
+        if (strncmp(cmd_ucase + 9, "MOVE ", 5) == 0)
+            mode = &stepModeMove;
+        else if (strncmp(cmd_ucase + 9, "DRAW ", 5) == 0)
+            mode = &stepModeDraw;
+        else
+        {
+            sendError("Error at argument.");
+            return CMD_UNKNOWN;
+        }
+
+        if (strncmp(cmd_ucase + 14, "FULL", 4) == 0)
+            *mode = STEP_MODE_FULL;
+        else if (strncmp(cmd_ucase + 14, "HALF", 4) == 0)
+            *mode = STEP_MODE_HALF;
+        else
+        {
+            sendError("Error at argument.");
+            return CMD_UNKNOWN;
+        }
+
+        // Applies to queued commands too, they are drawn later
+        sendAccepted();
+        sendEvent("FINISHED", commandSeq);
+    }
+    else if (strncmp(cmd_ucase, "TELEMETRY ", 10) == 0)
+    {
+        // TELEMETRY <interval in ms>, 0 turns it off
+        val[0] = strtol(cmd + 10, &endptr, 10);
+        if (*endptr != '\0' || val[0] < 0 || (val[0] > 0 && val[0] < TELEMETRY_MIN_MS) || val[0] > 60000)
+        {
+            sendError("Error at argument.");
+            return CMD_UNKNOWN;
+        }
+
+        telemetryInterval = val[0] / DELAY;
+        nextTelemetry = getTicks() + telemetryInterval;
+        sendAccepted();
+        sendEvent("FINISHED", commandSeq);
+    }
+    else if (strncmp(cmd_ucase, "CALIBRATE", 9) == 0)
+    {
+        if (checkBusy())
+            return USER_COMMAND;
+
+        sendAccepted();
+        sendEvent("STARTED", commandSeq);
+        penUp();
+        calibrate();
+        print_val2("Travel: ", travelX, travelY);
+        sendEvent("FINISHED", commandSeq);
     }
     else if (strcmp4(cmd_ucase, "DEMO"))
     {
+        if (checkBusy())
+            return USER_COMMAND;
+
         // Set up demo context
-        currentDrawing = DRAWING_FREE;
-        currentComplexDrawing = DRAWING_COMPLEX_DEMO;
-        currentComplexContext.dc.idx = 0;
-        term_send_str_crlf("Drawing started.");
+        currentComplexDrawing = DRAWING_COMPLEX_JOB;
+        currentComplexContext.jc.program = demo;
+        currentComplexContext.jc.idx = 0;
+        currentComplexContext.jc.feedRate = feedRate;
+        complexSeq = commandSeq;
+        sendAccepted();
+        sendEvent("STARTED", commandSeq);
+    }
+    else if (strncmp(cmd_ucase, "STORE ", 6) == 0)
+    {
+        if (!parseArguments(cmd + 6, val, 1))
+            return CMD_UNKNOWN;
+
+        if (val[0] < 0 || val[0] >= JOB_SLOT_COUNT)
+        {
+            sendError("Invalid job slot.");
+            return USER_COMMAND;
+        }
+
+        // Erasing flash stops the CPU, drawing would be jerky
+        if (checkBusy())
+            return USER_COMMAND;
+
+        // Following drawing commands are compiled into the slot until ENDSTORE
+        Job_erase(val[0]);
+        storing = STORE_WRITING;
+        storeSlot = val[0];
+        storeIdx = 1;
+        sendAccepted();
+        sendEvent("FINISHED", commandSeq);
+    }
+    else if (strcmp4(cmd_ucase, "RUN "))
+    {
+        if (!parseArguments(cmd + 4, val, 1))
+            return CMD_UNKNOWN;
+
+        if (val[0] < 0 || !Job_valid(val[0]))
+        {
+            sendError("No job stored in slot.");
+            return USER_COMMAND;
+        }
+
+        if (checkBusy())
+            return USER_COMMAND;
+
+        // Stored job is drawn the same way as demo
+        currentComplexDrawing = DRAWING_COMPLEX_JOB;
+        currentComplexContext.jc.program = Job_slot(val[0]) + 1;
+        currentComplexContext.jc.idx = 0;
+        currentComplexContext.jc.feedRate = feedRate;
+        complexSeq = commandSeq;
+        sendAccepted();
+        sendEvent("STARTED", commandSeq);
     }
     else if (strcmp8(cmd_ucase, "HILBERT "))
     {
@@ -392,7 +956,7 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
                 val[0] = strtol(arg, &endptr, 10);
                 break;
             default:
-                term_send_str_crlf("Too many arguments.");
+                sendError("Too many arguments.");
                 return CMD_UNKNOWN;
             }
             argc++;
@@ -400,7 +964,7 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
             if ((endptr - arg) != strlen(arg))
             {
                 // Argument wasn't fully converted - error
-                term_send_str_crlf("Error at argument.");
+                sendError("Error at argument.");
                 return CMD_UNKNOWN;
             }
             
@@ -409,9 +973,13 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
         
         if (argc != 1)
         {
-            term_send_str_crlf("Too few arguments.");
+            sendError("Too few arguments.");
+            return CMD_UNKNOWN;
         }
 
+        if (checkBusy())
+            return USER_COMMAND;
+
         // Set up Hilbert context
         currentComplexContext.hc.n = Hilbert_r2n(val[0]);
         // Image size and size of step in millimeters
@@ -421,12 +989,18 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
         int32_t internalSteps = mmToInternalStep(stepSize); 
         if (internalSteps > 0)
         {
+            if (!checkTravelRange(mmToInternalStep(20), mmToInternalStep(20),
+                                  mmToInternalStep(20) + (currentComplexContext.hc.n - 1) * internalSteps,
+                                  mmToInternalStep(20) + (currentComplexContext.hc.n - 1) * internalSteps))
+                return USER_COMMAND;
+
             currentComplexContext.hc.stepsPerLine = internalSteps;
             currentComplexContext.hc.idx = 0;
             currentComplexContext.hc.length = Hilbert_length(currentComplexContext.hc.n);
-            currentDrawing = DRAWING_FREE;
             currentComplexDrawing = DRAWING_COMPLEX_HILBERT;
-            term_send_str_crlf("Drawing started.");
+            complexSeq = commandSeq;
+            sendAccepted();
+            sendEvent("STARTED", commandSeq);
             
             // Move to starting position
             currentComplexContext.hc.startX = mmToInternalStep(20);
@@ -436,11 +1010,13 @@ unsigned char decode_user_cmd(char *cmd_ucase, char *cmd)
         }
         else
         {
-            term_send_str_crlf("Can't draw Hilbert's curve, the resolution is too large.");
+            sendError("Can't draw Hilbert's curve, the resolution is too large.");
         }
     }
     else 
     {
+        // Host waits for an event of every command it sends
+        sendError("Unknown command.");
         return CMD_UNKNOWN;
     }
     
@@ -494,7 +1070,52 @@ void penDown()
     }
 }
 
-void motorStep(uint8_t info)
+// Advance phase of motor, return number of half steps made
+uint8_t nextPhase(uint8_t *phase, uint8_t info, uint8_t *word)
+{
+    uint8_t delta = (info & MOTOR_DIR_MASK) == MOTOR_FORWARD ? 1 : motorPhasesCount - 1;
+
+    if ((info & MOTOR_FULL_STEP) && (*phase & 1))
+    {
+        // Motor is in two-phase-on position, jump directly to the next one
+        *phase = (*phase + 2*delta) % motorPhasesCount;
+        *word = motorFullPhases[*phase >> 1];
+        return 2;
+    }
+
+    // In full step mode this aligns motor to two-phase-on position
+    *phase = (*phase + delta) % motorPhasesCount;
+    *word = motorPhases[*phase];
+    return 1;
+}
+
+// Resolve area of head on one axis, return false if step in given direction is not allowed
+uint8_t resolveArea(uint8_t *area, uint8_t pressed, uint8_t lastDir, uint8_t direction)
+{
+    if (pressed)
+    {
+        if (*area == IN_DRAWING_AREA)
+        {
+            // Toggle was pressed in previous step.
+            if (lastDir == MOTOR_BACKWARD)
+                *area = BEFORE_DRAWING_AREA;
+            else
+                *area = AFTER_DRAWING_AREA;
+        }
+    }
+    else
+    {
+        // Head is in drawing area
+        *area = IN_DRAWING_AREA;
+    }
+
+    // Prevent moving further outside drawing area
+    return !((*area == BEFORE_DRAWING_AREA && direction == MOTOR_BACKWARD) || (*area == AFTER_DRAWING_AREA && direction == MOTOR_FORWARD));
+}
+
+// Make a step with both motors at once, motor with MOTOR_IDLE info stays in place.
+// Number of half steps made by each motor is returned through movedX and movedY.
+void motorStepXY(uint8_t infoX, uint8_t infoY, uint8_t *movedX, uint8_t *movedY)
 {
     static uint8_t motorXCurrentPhase = 0;
     static uint8_t motorYCurrentPhase = 0;
@@ -502,228 +1123,296 @@ void motorStep(uint8_t info)
     static uint8_t lastMotorXDir = MOTOR_BACKWARD;
     static uint8_t lastMotorYDir = MOTOR_BACKWARD;
     
-    uint8_t direction = info & MOTOR_DIR_MASK;
-    int8_t nextPhase = (direction == MOTOR_FORWARD ? 1 : -1);
-    uint8_t nextWord = 0;
-        
-    if ((info & MOTOR_MASK) == MOTOR_X)
+    // Both toggles are on the same port, read them only once
+    uint8_t toggles = TOGGLE_X_PORT;
+    uint8_t mask = 0, words = 0, nextWord;
+
+    *movedX = 0;
+    *movedY = 0;
+
+    if ((infoX & MOTOR_IDLE) == 0)
     {
-        // Resolve head position
-        if ((TOGGLE_X_PORT & TOGGLE_X_MASK) == 0)
+        if (resolveArea(&headXArea, (toggles & TOGGLE_X_MASK) == 0, lastMotorXDir, infoX & MOTOR_DIR_MASK))
         {
-            if (headXArea == IN_DRAWING_AREA)
-            {
-                // Toggle was pressed in previous step.
-                if (lastMotorXDir == MOTOR_BACKWARD)
-                    headXArea = BEFORE_DRAWING_AREA;
-                else
-                    headXArea = AFTER_DRAWING_AREA;
-            }
+            *movedX = nextPhase(&motorXCurrentPhase, infoX, &nextWord);
+            words |= nextWord << MOTOR_X_PIN_OFFSET;
+            mask |= MOTOR_X_PIN_MASK;
+            lastMotorXDir = infoX & MOTOR_DIR_MASK;
+            set_led_d5(0);
         }
         else
-        {
-            // Head is in drawing area
-            headXArea = IN_DRAWING_AREA;
-        }
-    
-        // Prevent moving further outside drawing area
-        if ((headXArea == BEFORE_DRAWING_AREA && direction == MOTOR_BACKWARD) || (headXArea == AFTER_DRAWING_AREA && direction == MOTOR_FORWARD))
         {
             set_led_d5(1);
-            return;
         }
-        
-        motorXCurrentPhase = (motorXCurrentPhase + (uint8_t)(nextPhase + motorPhasesCount)) % motorPhasesCount;
-        nextWord = motorPhases[motorXCurrentPhase] << MOTOR_X_PIN_OFFSET;
-        lastMotorXDir = info & MOTOR_DIR_MASK;
-        // Send next word on port while preserving the unused pins
-        MOTOR_X_PORT = (MOTOR_X_PORT & (~MOTOR_X_PIN_MASK)) | nextWord;
-        //TODO: Debug mode?
-        //term_send_str_crlf("Krok X.");
-        set_led_d5(0);
     }
-    else 
+
+    if ((infoY & MOTOR_IDLE) == 0)
     {
-        // Resolve head position
-        if ((TOGGLE_Y_PORT & TOGGLE_Y_MASK) == 0)
+        if (resolveArea(&headYArea, (toggles & TOGGLE_Y_MASK) == 0, lastMotorYDir, infoY & MOTOR_DIR_MASK))
         {
-            if (headYArea == IN_DRAWING_AREA)
-            {
-                // Toggle was pressed in previous step.
-                if (lastMotorYDir == MOTOR_BACKWARD)
-                    headYArea = BEFORE_DRAWING_AREA;
-                else
-                    headYArea = AFTER_DRAWING_AREA;
-            }
+            *movedY = nextPhase(&motorYCurrentPhase, infoY, &nextWord);
+            words |= nextWord << MOTOR_Y_PIN_OFFSET;
+            mask |= MOTOR_Y_PIN_MASK;
+            lastMotorYDir = infoY & MOTOR_DIR_MASK;
+            set_led_d6(0);
         }
         else
-        {
-            // Head is in drawing area
-            headYArea = IN_DRAWING_AREA;
-        }
-    
-        // Prevent moving further outside drawing area
-        if ((headYArea == BEFORE_DRAWING_AREA && direction == MOTOR_BACKWARD) || (headYArea == AFTER_DRAWING_AREA && direction == MOTOR_FORWARD))
         {
             set_led_d6(1);
-            return;
         }
-        
-        motorYCurrentPhase = (motorYCurrentPhase + (uint8_t)(nextPhase + motorPhasesCount)) % motorPhasesCount;
-        nextWord = motorPhases[motorYCurrentPhase] << MOTOR_Y_PIN_OFFSET;
-        lastMotorYDir = info & MOTOR_DIR_MASK;
-        // Send next word on port while preserving the unused pins
-        MOTOR_Y_PORT = (MOTOR_Y_PORT & (~MOTOR_Y_PIN_MASK)) | nextWord;
-        //TODO: Debug mode?
-        //term_send_str_crlf("Krok Y.");
-        set_led_d6(0);
     }
+
+    // Both motors are on the same port as well, send next words
+    // in one write while preserving the unused pins
+    if (mask)
+        MOTOR_X_PORT = (MOTOR_X_PORT & (~mask)) | words;
 }
 
-void moveToOrigin()
+// Move both axes at once until each of them reaches given area
+void moveToArea(uint8_t direction, uint8_t area, uint16_t delay)
 {
-    // First move head before drawing area to find origin
-    while (headXArea != BEFORE_DRAWING_AREA)
-    {
-        motorStep(MOTOR_X | MOTOR_BACKWARD);
-        delay_ms(DELAY);
-    }
-    while (headYArea != BEFORE_DRAWING_AREA)
+    uint8_t movedX, movedY;
+
+    while (headXArea != area || headYArea != area)
     {
-        motorStep(MOTOR_Y | MOTOR_BACKWARD);
-        delay_ms(DELAY);
+        motorStepXY(headXArea != area ? MOTOR_X | direction : MOTOR_IDLE,
+                    headYArea != area ? MOTOR_Y | direction : MOTOR_IDLE, &movedX, &movedY);
+        delay_ms(delay);
     }
+}
+
+void moveToOrigin()
+{
+    uint16_t i;
+    uint8_t movedX, movedY;
+
+    // Quickly find the toggles with both axes
+    moveToArea(MOTOR_BACKWARD, BEFORE_DRAWING_AREA, HOME_SEEK_DELAY);
     
-    // Then return it to drawing area
-    while (headXArea != IN_DRAWING_AREA)
+    // Back off a little
+    moveToArea(MOTOR_FORWARD, IN_DRAWING_AREA, HOME_SEEK_DELAY);
+    for (i = 0; i < HOME_BACKOFF_STEPS; i++)
     {
-        motorStep(MOTOR_X | MOTOR_FORWARD);
-        delay_ms(DELAY);
+        motorStepXY(MOTOR_X | MOTOR_FORWARD, MOTOR_Y | MOTOR_FORWARD, &movedX, &movedY);
+        delay_ms(HOME_SEEK_DELAY);
     }
-    while (headYArea != IN_DRAWING_AREA)
+    
+    // Approach the toggles again slowly and return head to drawing area
+    moveToArea(MOTOR_BACKWARD, BEFORE_DRAWING_AREA, HOME_APPROACH_DELAY);
+    moveToArea(MOTOR_FORWARD, IN_DRAWING_AREA, HOME_APPROACH_DELAY);
+
+    // This is the new origin
+    internalHeadX = 0;
+    internalHeadY = 0;
+    realHeadX = 0;
+    realHeadY = 0;
+}
+
+// Measure travel between toggles and turn it into soft limits
+void calibrate()
+{
+    int32_t stepsX = 0, stepsY = 0;
+    uint8_t movedX, movedY;
+
+    moveToOrigin();
+
+    // Count the steps until the far toggles are pressed, slowly so that
+    // no step is missed and counted into the limits
+    while (headXArea != AFTER_DRAWING_AREA || headYArea != AFTER_DRAWING_AREA)
     {
-        motorStep(MOTOR_Y | MOTOR_FORWARD);
-        delay_ms(DELAY);
+        // Step is refused once toggle is found
+        motorStepXY(headXArea != AFTER_DRAWING_AREA ? MOTOR_X | MOTOR_FORWARD : MOTOR_IDLE,
+                    headYArea != AFTER_DRAWING_AREA ? MOTOR_Y | MOTOR_FORWARD : MOTOR_IDLE, &movedX, &movedY);
+        stepsX += movedX;
+        stepsY += movedY;
+        delay_ms(HOME_APPROACH_DELAY);
     }
+
+    travelX = realToInternalStep(stepsX - CALIBRATE_MARGIN_STEPS, MOTOR_X_STEP_MM);
+    travelY = realToInternalStep(stepsY - CALIBRATE_MARGIN_STEPS, MOTOR_Y_STEP_MM);
+    calibrated = 1;
+    // Host resets the device with every session, limits must survive it
+    Info_saveTravel(travelX, travelY);
+
+    moveToOrigin();
+}
+
+// Return step info for motor moving toward its target position
+uint8_t stepToward(uint8_t motor, int32_t diff, uint8_t area, uint8_t mode)
+{
+    uint8_t info;
+
+    if (diff > 0 && area != AFTER_DRAWING_AREA)
+        info = motor | MOTOR_FORWARD;
+    else if (diff < 0 && area != BEFORE_DRAWING_AREA)
+        info = motor | MOTOR_BACKWARD;
+    else
+        return MOTOR_IDLE;
+
+    // Full step would overshoot the target by a half step
+    if (mode == STEP_MODE_FULL && (diff >= 2 || diff <= -2))
+        info |= MOTOR_FULL_STEP;
+
+    return info;
+}
+
+void setFeedRate(int32_t rate)
+{
+    feedRate = rate;
+    feedPerTick = m_round(rate * (DELAY * FEED_UNIT / (1000 * INTERNAL_STEP_MM)));
+    feedBudget = 0;
+}
+
+// Earn path length of one tick, budget unused while moving or waiting is kept only up to one step
+void feedTick()
+{
+    if (feedRate == 0)
+        return;
+
+    feedBudget += feedPerTick;
+    if (feedBudget > FEED_DIAGONAL)
+        feedBudget = FEED_DIAGONAL;
+}
+
+// Return true if the pen may cut its next step in this tick, the step is paid
+// after it is made, so the speed is kept no matter which direction it goes
+uint8_t feedAllows()
+{
+    return feedRate == 0 || feedBudget >= 0;
 }
 
 // Return false if at final position, true otherwise
 uint8_t moveToward(int32_t x, int32_t y, uint8_t cutting)
 {
-    if (x > internalHeadX)
-    {
-        internalHeadX++;
-    }
-    else if (x < internalHeadX)
-    {
-        internalHeadX--;
-    }
-    
-    if (y > internalHeadY)
-    {
-        internalHeadY++;
-    }
-    else if (y < internalHeadY)
+    uint8_t mode = cutting ? stepModeDraw : stepModeMove;
+    int32_t newRealX, newRealY;
+    uint8_t infoX, infoY, movedX, movedY;
+    uint8_t axes = 0;
+
+    if (!cutting && mode == STEP_MODE_FULL)
     {
-        internalHeadY--;
+        // Rapid move, motors head straight for the final position
+        newRealX = internalToRealStep(x, MOTOR_X_STEP_MM);
+        newRealY = internalToRealStep(y, MOTOR_Y_STEP_MM);
     }
-    
-    int32_t newRealX = internalToRealStep(internalHeadX, MOTOR_X_STEP_MM);
-    int32_t newRealY = internalToRealStep(internalHeadY, MOTOR_Y_STEP_MM);
-    
-    if (cutting && headXArea == IN_DRAWING_AREA && headYArea == IN_DRAWING_AREA)
-        penDown();
     else
-        penUp();
-    
-    if (newRealX > realHeadX)
     {
-        if (headXArea != AFTER_DRAWING_AREA)
+        if (x > internalHeadX)
         {
-            motorStep(MOTOR_X | MOTOR_FORWARD);
-            realHeadX++;
+            internalHeadX++;
+            axes++;
         }
-    }
-    else if (newRealX < realHeadX)
-    {
-        if (headXArea != BEFORE_DRAWING_AREA)
+        else if (x < internalHeadX)
         {
-            motorStep(MOTOR_X | MOTOR_BACKWARD);
-            realHeadX--;
+            internalHeadX--;
+            axes++;
         }
-    }
-    
-    if (newRealY > realHeadY)
-    {
-        if (headYArea != AFTER_DRAWING_AREA)
+        
+        if (y > internalHeadY)
         {
-            motorStep(MOTOR_Y | MOTOR_FORWARD);
-            realHeadY++;
+            internalHeadY++;
+            axes++;
         }
-    }
-    else if (newRealY < realHeadY)
-    {
-        if (headYArea != BEFORE_DRAWING_AREA)
+        else if (y < internalHeadY)
         {
-            motorStep(MOTOR_Y | MOTOR_BACKWARD);
-            realHeadY--;
+            internalHeadY--;
+            axes++;
         }
+
+        if (cutting && feedRate != 0)
+            feedBudget -= axes == 2 ? FEED_DIAGONAL : axes * FEED_UNIT;
+        
+        newRealX = internalToRealStep(internalHeadX, MOTOR_X_STEP_MM);
+        newRealY = internalToRealStep(internalHeadY, MOTOR_Y_STEP_MM);
     }
     
-    //TODO: Debug mode?
-    //print_val2("Head moved to: ", internalHeadX, internalHeadY);
+    if (cutting && headXArea == IN_DRAWING_AREA && headYArea == IN_DRAWING_AREA)
+        penDown();
+    else
+        penUp();
+    
+    infoX = stepToward(MOTOR_X, newRealX - realHeadX, headXArea, mode);
+    infoY = stepToward(MOTOR_Y, newRealY - realHeadY, headYArea, mode);
+    motorStepXY(infoX, infoY, &movedX, &movedY);
+
+    if ((infoX & MOTOR_DIR_MASK) == MOTOR_FORWARD)
+        realHeadX += movedX;
+    else
+        realHeadX -= movedX;
+
+    if ((infoY & MOTOR_DIR_MASK) == MOTOR_FORWARD)
+        realHeadY += movedY;
+    else
+        realHeadY -= movedY;
+
+    if (!cutting && mode == STEP_MODE_FULL)
+    {
+        // Derive internal position from the real one, axis that
+        // arrived or can't move any further is at its final position
+        if (movedX == 0 || realHeadX == newRealX)
+            internalHeadX = x;
+        else
+            internalHeadX = realToInternalStep(realHeadX, MOTOR_X_STEP_MM);
+
+        if (movedY == 0 || realHeadY == newRealY)
+            internalHeadY = y;
+        else
+            internalHeadY = realToInternalStep(realHeadY, MOTOR_Y_STEP_MM);
+    }
     
     return x == internalHeadX && y == internalHeadY ? OPERATION_FINISHED : OPERATION_IN_PROGRESS;
 }
 
-void drawLine (int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+void initLineContext (LineContext* lc, int32_t x1, int32_t y1, int32_t x2, int32_t y2)
 {
-    LineContext lc;
     int32_t dx, dy;
     
     // If head already in starting position, begin cutting.
     // Needs to be done before coordinates swap.
     if (x1 == internalHeadX && y1 == internalHeadY)
     {
-        lc.state = STATE_CUTTING;
+        lc->state = STATE_CUTTING;
     }
     else
     {
-        lc.state = STATE_MOVING;
+        lc->state = STATE_MOVING;
     }
     
-    lc.leftRight = x2 >= x1;
+    lc->leftRight = x2 >= x1;
 
     //Bressenhamov algoritmus
-    dx = lc.leftRight ? (x2 - x1) : (x1 - x2);
+    dx = lc->leftRight ? (x2 - x1) : (x1 - x2);
     dy = m_abs_int(y2 - y1);
-    lc.makeSwap = 0;
+    lc->makeSwap = 0;
     if (dx < dy)
     {
         swap(&x1, &y1);
         swap(&x2, &y2);
 
-        lc.leftRight = x2 >= x1;
+        lc->leftRight = x2 >= x1;
 
-        dx = lc.leftRight ? (x2 - x1) : (x1 - x2);
+        dx = lc->leftRight ? (x2 - x1) : (x1 - x2);
         dy = m_abs_int(y2 - y1);
-        lc.makeSwap = 1;
+        lc->makeSwap = 1;
     }
 
     // Fill context with necessary data
-    lc.x1 = x1; lc.y1 = y1;
-    lc.x2 = x2; lc.y2 = y2;
-    lc.dx = dx; lc.dy = dy;
-    lc.P1 = 2*dy;
-    lc.P2 = lc.P1 - 2*dx;
-    lc.P  = 2*dy - dx;
-    lc.x = x1; lc.y  = y1;
-    lc.ystep = y2 >= y1 ? 1 : -1;
+    lc->x1 = x1; lc->y1 = y1;
+    lc->x2 = x2; lc->y2 = y2;
+    lc->dx = dx; lc->dy = dy;
+    lc->P1 = 2*dy;
+    lc->P2 = lc->P1 - 2*dx;
+    lc->P  = 2*dy - dx;
+    lc->x = x1; lc->y  = y1;
+    lc->ystep = y2 >= y1 ? 1 : -1;
     
+}
+
+void drawLine (int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
     // Prepare global variables
+    initLineContext(&(currentContext.lc), x1, y1, x2, y2);
     currentDrawing = DRAWING_LINE;
-    currentContext.lc = lc;
-    term_send_str_crlf("Moving into starting position.");
 }
 
 // Return false if finished, true otherwise
@@ -742,7 +1431,6 @@ uint8_t drawLineStep(LineContext* lc)
         if (tmp == OPERATION_FINISHED)
         {
             // If finished moving, start cutting
-            term_send_str_crlf("Cutting.");
             lc->state = STATE_CUTTING;
         }
         
@@ -755,6 +1443,9 @@ uint8_t drawLineStep(LineContext* lc)
             lc->state = STATE_FINISHED;
             return OPERATION_FINISHED;
         }
+
+        if (!feedAllows())
+            return OPERATION_IN_PROGRESS;
         
         // Perform next step of algorithm
         if(lc->P >= 0)
@@ -789,21 +1480,65 @@ uint8_t drawLineStep(LineContext* lc)
     }
 }
 
-void drawCircle (int32_t sx, int32_t sy, int32_t R)
+// Quadrants of circle in clockwise order from the top, each is drawn
+// as two octants, in the first one x grows and in the second one it shrinks
+const int8_t circleQuadrantI[4] = {1, 1, -1, -1};
+const int8_t circleQuadrantJ[4] = {1, -1, -1, 1};
+
+int32_t circleY(int32_t R, int32_t x)
+{
+    return m_round(m_sqrt_int((double)(R*R - x*x)));
+}
+
+void drawCircle (int32_t sx, int32_t sy, int32_t R, uint8_t octant)
 {
     // Fill context with necessary data
     CircleContext cc;
+    int32_t x = 0, y = R;
     cc.x = 0;
-    cc.i = 1; cc.j = 1;
     cc.sx = sx; cc.sy = sy;
     cc.R = R;
     cc.state = STATE_MOVING;
     cc.xGrow = 1;
+    cc.octants = 8;
+
+    if (octant & 1)
+    {
+        // Odd octant starts where growing x reaches y, start close to it
+        x = R * 46341 / 65536;
+        while (x > 0 && x - 1 >= circleY(R, x - 1))
+            x--;
+        while (x < circleY(R, x))
+            x++;
+        y = circleY(R, x);
+
+        cc.x = x > y ? x - 1 : x;
+        cc.xGrow = 0;
+        if (cc.x == 0)
+        {
+            // Tiny circle, the octant is only a point shared with the next one
+            octant++;
+            x = 0; y = R;
+            cc.xGrow = 1;
+        }
+    }
+
+    cc.i = circleQuadrantI[(octant / 2) % 4];
+    cc.j = circleQuadrantJ[(octant / 2) % 4];
+    if (cc.i * cc.j > 0)
+    {
+        cc.startX = sx + x * cc.i;
+        cc.startY = sy + y * cc.j;
+    }
+    else
+    {
+        cc.startX = sx + y * cc.i;
+        cc.startY = sy + x * cc.j;
+    }
     
     // Prepare global variables
     currentDrawing = DRAWING_CIRCLE;
     currentContext.cc = cc;
-    term_send_str_crlf("Moving into starting position.");
 
     return;
 }
@@ -811,25 +1546,28 @@ void drawCircle (int32_t sx, int32_t sy, int32_t R)
 uint8_t drawCircleStep(CircleContext* cc)
 {
     int32_t x, y, yTmp;
+    uint8_t octantEnded = 0;
 
     switch(cc->state)
     {
     case STATE_MOVING:
-        if (moveToward(cc->sx, cc->sy + cc->R, 0) == OPERATION_FINISHED)
+        if (moveToward(cc->startX, cc->startY, 0) == OPERATION_FINISHED)
         {
             // If finished moving, start cutting
-            term_send_str_crlf("Cutting.");
             cc->state = STATE_CUTTING;
         }
         
         return OPERATION_IN_PROGRESS;
     
     case STATE_CUTTING:
+        if (!feedAllows())
+            return OPERATION_IN_PROGRESS;
+
         // Perform next step of algorithm
         if (cc->xGrow)
         {
             cc->x++;
-            yTmp = m_round(m_sqrt_int((double)(cc->R*cc->R - cc->x*cc->x)));
+            yTmp = circleY(cc->R, cc->x);
             if (cc->i * cc->j > 0)
             {
                 x = cc->x;
@@ -844,6 +1582,7 @@ uint8_t drawCircleStep(CircleContext* cc)
             if (cc->x >= yTmp)
             {
                 cc->xGrow = 0;
+                octantEnded = 1;
                 if (cc->x > yTmp)
                 {
                     cc->x--;
@@ -853,7 +1592,7 @@ uint8_t drawCircleStep(CircleContext* cc)
         else
         {
             cc->x--;
-            yTmp = m_round(m_sqrt_int((double)(cc->R*cc->R - cc->x*cc->x)));
+            yTmp = circleY(cc->R, cc->x);
             if (cc->i * cc->j > 0)
             {
                 x = yTmp;
@@ -864,41 +1603,48 @@ uint8_t drawCircleStep(CircleContext* cc)
                 x = cc->x;
                 y = yTmp;
             }
-            
-            if (cc->x == 0)
-            {
-                cc->xGrow = 1;
-            }
         }
 
         // Set new head position
         moveToward(cc->sx + x * cc->i, cc->sy + y * cc->j, 1);
+
+        // Circle is closed when all eight octants are drawn
+        if (octantEnded && --cc->octants == 0)
+        {
+            cc->state = STATE_FINISHED;
+            return OPERATION_FINISHED;
+        }
         
         // Each time x reaches zero, new quadrate begins
         if (cc->x == 0)
         {
-            if (cc->i < 0)
+            if (--cc->octants == 0)
+            {
+                cc->state = STATE_FINISHED;
+                return OPERATION_FINISHED;
+            }
+
+            cc->xGrow = 1;
+            if (cc->i > 0)
             {
                 if (cc->j > 0)
                 {
-                    // i = -1, j = 1 and x = 0 is final position
-                    cc->state = STATE_FINISHED;
-                    return OPERATION_FINISHED;
+                    cc->j = -1;
                 }
                 else
                 {
-                    cc->j = 1;
+                    cc->i = -1;
                 }
             }
             else
             {
-                if (cc->j > 0)
+                if (cc->j < 0)
                 {
-                    cc->j = -1;
+                    cc->j = 1;
                 }
                 else
                 {
-                    cc->i = -1;
+                    cc->i = 1;
                 }
             }
         }
@@ -910,42 +1656,357 @@ uint8_t drawCircleStep(CircleContext* cc)
     }
 }
 
-uint8_t drawDemo(DemoContext* dc)
+void drawPolyline (int32_t x, int32_t y)
 {
-    int32_t idx = dc->idx;
-    int32_t item;
-    int32_t a, b, c, d;
-    
-    item = demo[idx++];
-    switch (item)
+    PolylineContext* pc = &(currentContext.pc);
+
+    // Degenerated line only moves head into starting position
+    initLineContext(&(pc->lc), x, y, x, y);
+    pc->first = 0;
+    pc->count = 0;
+    pc->closed = 0;
+    pc->seq = runningSeq;
+    // Segments of complex drawing are reported as a whole
+    pc->reporting = (currentComplexDrawing == DRAWING_COMPLEX_FREE);
+    pc->reportPending = pc->reporting;
+    pc->reportEnd = 0;
+
+    // Prepare global variables
+    currentDrawing = DRAWING_POLYLINE;
+}
+
+// Return false if buffer is full, true otherwise
+uint8_t addPolylineVertex (int32_t x, int32_t y, uint16_t seq)
+{
+    PolylineContext* pc = &(currentContext.pc);
+    uint8_t idx;
+
+    if (pc->count >= POLYLINE_BUFFER_SIZE || pc->closed)
+        return 0;
+
+    idx = (pc->first + pc->count) % POLYLINE_BUFFER_SIZE;
+    pc->vx[idx] = x;
+    pc->vy[idx] = y;
+    pc->vseq[idx] = seq;
+    pc->count++;
+
+    return 1;
+}
+
+// Whole polyline is reported finished under sequence number of its end
+void endPolyline (uint16_t seq)
+{
+    currentContext.pc.closed = 1;
+    currentContext.pc.reportEnd = 1;
+    runningSeq = seq;
+}
+
+// Return false if finished, true otherwise
+uint8_t drawPolylineStep(PolylineContext* pc)
+{
+    // Whenever a segment ends, continue with the next one in the same tick
+    // so the pen neither stops nor rises between vertices.
+    while (drawLineStep(&(pc->lc)) == OPERATION_FINISHED)
     {
-    case DEMO_LINE:
-        a = demo[idx++];
-        b = demo[idx++];
-        c = demo[idx++];
-        d = demo[idx++];
-        drawLine(a, b, c, d);
+        // Segment stays finished while waiting for vertices, report it once
+        if (pc->reportPending)
+        {
+            sendEvent("FINISHED", pc->seq);
+            pc->reportPending = 0;
+        }
+
+        if (pc->count == 0)
+        {
+            // Keep the pen down while waiting for further vertices
+            return pc->closed ? OPERATION_FINISHED : OPERATION_IN_PROGRESS;
+        }
+
+        initLineContext(&(pc->lc), internalHeadX, internalHeadY, pc->vx[pc->first], pc->vy[pc->first]);
+        pc->seq = pc->vseq[pc->first];
+        pc->reportPending = pc->reporting;
+        pc->first = (pc->first + 1) % POLYLINE_BUFFER_SIZE;
+        pc->count--;
+    }
+
+    return OPERATION_IN_PROGRESS;
+}
+
+int32_t fixedToInternalStep(int64_t a)
+{
+    return (int32_t)((a + ((int64_t)1 << (BEZIER_FRAC_BITS - 1))) >> BEZIER_FRAC_BITS);
+}
+
+// Points are given as x0, y0, x1, y1, x2, y2, x3, y3
+void drawBezier (int32_t *p)
+{
+    BezierContext* bc = &(currentContext.bc);
+    int32_t ax, ay, bx, by, cx, cy, m, t;
+    uint8_t k = 0;
+
+    // Polynomial coefficients, B(t) = a*t^3 + b*t^2 + c*t + p0
+    ax = -p[0] + 3*p[2] - 3*p[4] + p[6];
+    ay = -p[1] + 3*p[3] - 3*p[5] + p[7];
+    bx = 3*p[0] - 6*p[2] + 3*p[4];
+    by = 3*p[1] - 6*p[3] + 3*p[5];
+    cx = 3*(p[2] - p[0]);
+    cy = 3*(p[3] - p[1]);
+
+    // Chord of n-th part deviates from curve at most by 3/4 * m / n^2,
+    // where m is the largest second difference of control points.
+    m = m_abs_int(p[0] - 2*p[2] + p[4]);
+    t = m_abs_int(p[1] - 2*p[3] + p[5]);
+    if (t > m) m = t;
+    t = m_abs_int(p[2] - 2*p[4] + p[6]);
+    if (t > m) m = t;
+    t = m_abs_int(p[3] - 2*p[5] + p[7]);
+    if (t > m) m = t;
+
+    while (k < BEZIER_MAX_LOG2 && 4 * BEZIER_TOLERANCE * ((int32_t)1 << (2*k)) < 3 * m)
+        k++;
+
+    // With n = 2^k all the differences are exact in fixed point,
+    // so the last chord ends precisely at p3.
+    bc->x = (int64_t)p[0] << BEZIER_FRAC_BITS;
+    bc->y = (int64_t)p[1] << BEZIER_FRAC_BITS;
+    bc->dx3 = (int64_t)(6*ax) << (BEZIER_FRAC_BITS - 3*k);
+    bc->dy3 = (int64_t)(6*ay) << (BEZIER_FRAC_BITS - 3*k);
+    bc->dx2 = bc->dx3 + ((int64_t)(2*bx) << (BEZIER_FRAC_BITS - 2*k));
+    bc->dy2 = bc->dy3 + ((int64_t)(2*by) << (BEZIER_FRAC_BITS - 2*k));
+    bc->dx1 = ((int64_t)ax << (BEZIER_FRAC_BITS - 3*k)) + ((int64_t)bx << (BEZIER_FRAC_BITS - 2*k))
+              + ((int64_t)cx << (BEZIER_FRAC_BITS - k));
+    bc->dy1 = ((int64_t)ay << (BEZIER_FRAC_BITS - 3*k)) + ((int64_t)by << (BEZIER_FRAC_BITS - 2*k))
+              + ((int64_t)cy << (BEZIER_FRAC_BITS - k));
+    bc->segments = (uint16_t)1 << k;
+
+    // Degenerated line only moves head into starting position
+    initLineContext(&(bc->lc), p[0], p[1], p[0], p[1]);
+
+    // Prepare global variables
+    currentDrawing = DRAWING_BEZIER;
+}
+
+// Return false if finished, true otherwise
+uint8_t drawBezierStep(BezierContext* bc)
+{
+    // Continue with next chord in the same tick as previous one ended
+    while (drawLineStep(&(bc->lc)) == OPERATION_FINISHED)
+    {
+        if (bc->segments == 0)
+            return OPERATION_FINISHED;
+
+        bc->x += bc->dx1;
+        bc->y += bc->dy1;
+        bc->dx1 += bc->dx2;
+        bc->dy1 += bc->dy2;
+        bc->dx2 += bc->dx3;
+        bc->dy2 += bc->dy3;
+        bc->segments--;
+
+        initLineContext(&(bc->lc), internalHeadX, internalHeadY,
+                        fixedToInternalStep(bc->x), fixedToInternalStep(bc->y));
+    }
+
+    return OPERATION_IN_PROGRESS;
+}
+
+// Start drawing operation, return false if it can't be drawn on its own
+uint8_t startOperation(uint8_t op, int32_t *args)
+{
+    switch (op)
+    {
+    case JOB_LINE:
+        drawLine(args[0], args[1], args[2], args[3]);
+        break;
+    case JOB_CIRCLE:
+        drawCircle(args[0], args[1], args[2], args[3]);
         break;
-    case DEMO_CIRCLE:
-        a = demo[idx++];
-        b = demo[idx++];
-        c = demo[idx++];
-        drawCircle(a, b, c);
+    case JOB_CUT:
+        drawLine(internalHeadX, internalHeadY, args[0], args[1]);
         break;
-    case DEMO_CUT:
-        a = demo[idx++];
-        b = demo[idx++];
-        drawLine(internalHeadX, internalHeadY, a, b);
+    case JOB_POLYLINE:
+        drawPolyline(args[0], args[1]);
         break;
-    case DEMO_END:
+    case JOB_BEZIER:
+        drawBezier(args);
+        break;
+    case JOB_FEED:
+        // Applies from the next operation on, there is nothing to draw
+        setFeedRate(args[0]);
+        return 0;
     default:
+        return 0;
+    }
+
+    return 1;
+}
+
+// Start next operation of job, return true if job is finished
+uint8_t drawJob(JobContext* jc)
+{
+    const int16_t *p = jc->program + jc->idx;
+    int32_t args[JOB_MAX_ARGS];
+    uint8_t op = p[0], i;
+    
+    if (op >= JOB_OPCODE_COUNT || op == JOB_END)
+    {
+        setFeedRate(jc->feedRate);
         return 1;
     }
+
+    for (i = 0; i < jobArgCount[op]; i++)
+        args[i] = p[i + 1];
+    jc->idx += 1 + jobArgCount[op];
+
+    // Vertices outside of polyline are skipped
+    if (startOperation(op, args) && op == JOB_POLYLINE)
+        feedPolyline(jc);
     
-    dc->idx = idx;
     return 0;
 }
 
+// Pass following vertices of job into running polyline while there is space for them
+void feedPolyline(JobContext* jc)
+{
+    const int16_t *p;
+
+    if (currentContext.pc.closed)
+        return;
+
+    while (1)
+    {
+        p = jc->program + jc->idx;
+        if (p[0] != JOB_VERTEX)
+            break;
+        if (!addPolylineVertex(p[1], p[2], 0))
+            return;
+        jc->idx += 1 + jobArgCount[JOB_VERTEX];
+    }
+
+    if (p[0] == JOB_POLYEND)
+        jc->idx++;
+    endPolyline(0);
+}
+
+// Remove first command from the queue
+void dropQueuedCommand()
+{
+    queueFirst = (queueFirst + 1) % COMMAND_QUEUE_SIZE;
+    queueCount--;
+    creditChanged = 1;
+}
+
+// Start first queued command, return false if nothing was started
+uint8_t startQueuedCommand()
+{
+    QueuedCommand *qc;
+    int32_t args[JOB_MAX_ARGS];
+    uint8_t i;
+
+    while (queueCount > 0)
+    {
+        qc = &commandQueue[queueFirst];
+        for (i = 0; i < jobArgCount[qc->op]; i++)
+            args[i] = qc->args[i];
+        runningSeq = qc->seq;
+        dropQueuedCommand();
+
+        if (startOperation(qc->op, args))
+        {
+            sendEvent("STARTED", runningSeq);
+            return 1;
+        }
+
+        // Vertices outside of polyline and feed rate have nothing to draw
+        sendEvent("FINISHED", runningSeq);
+    }
+
+    return 0;
+}
+
+// Pass queued vertices into running polyline while there is space for them
+void feedPolylineFromQueue()
+{
+    QueuedCommand *qc;
+
+    while (queueCount > 0 && !currentContext.pc.closed)
+    {
+        qc = &commandQueue[queueFirst];
+        if (qc->op == JOB_VERTEX)
+        {
+            if (!addPolylineVertex(qc->args[0], qc->args[1], qc->seq))
+                return;
+            dropQueuedCommand();
+        }
+        else if (qc->op == JOB_POLYEND)
+        {
+            endPolyline(qc->seq);
+            dropQueuedCommand();
+        }
+        else
+        {
+            // Polyline without end, its last segment is reported on its own,
+            // next command is left for later
+            currentContext.pc.closed = 1;
+        }
+    }
+}
+
+// Compile operation into stored job instead of drawing it
+void storeOperation(uint8_t op, int32_t *args)
+{
+    uint8_t i;
+
+    // Keep space for terminating operation
+    if (storeIdx + 1 + jobArgCount[op] >= JOB_SLOT_WORDS)
+    {
+        storing = STORE_FAILED;
+        sendError("Job does not fit into slot.");
+        return;
+    }
+
+    Job_write(storeSlot, storeIdx++, op);
+    for (i = 0; i < jobArgCount[op]; i++)
+        Job_write(storeSlot, storeIdx++, (int16_t)args[i]);
+
+    sendAccepted();
+    sendEvent("FINISHED", commandSeq);
+}
+
+// Store operation into job or queue it for drawing
+void submitOperation(uint8_t op, int32_t *args)
+{
+    QueuedCommand *qc;
+    uint8_t i;
+
+    if (storing)
+    {
+        storeOperation(op, args);
+        return;
+    }
+
+    if (queueCount >= COMMAND_QUEUE_SIZE)
+    {
+        sendError("Queue is full.");
+        return;
+    }
+
+    qc = &commandQueue[(queueFirst + queueCount) % COMMAND_QUEUE_SIZE];
+    qc->seq = commandSeq;
+    qc->op = op;
+    for (i = 0; i < jobArgCount[op]; i++)
+        qc->args[i] = args[i];
+    queueCount++;
+
+    sendAccepted();
+}
+
+// Operations of complex drawings are reported as a whole
+void reportFinished()
+{
+    if (currentComplexDrawing == DRAWING_COMPLEX_FREE)
+        sendEvent("FINISHED", runningSeq);
+}
+
 uint8_t drawHilbert(HilbertContext* hc)
 {
     int32_t hx = 0, hy = 0;
@@ -962,6 +2023,49 @@ uint8_t drawHilbert(HilbertContext* hc)
     return 1;
 }
 
+// Timer interrupt wakes the CPU up on exit
+wakeup interrupt (TIMERA0_VECTOR) Timer_A (void)
+{
+    CCR0 += TICK_PERIOD;
+    ticks++;
+    tickElapsed = 1;
+}
+
+void initializeTicks()
+{
+    // ACLK, continuous mode
+    CCTL0 = CCIE;
+    CCR0 = TICK_PERIOD;
+    TACTL = TASSEL_1 + MC_2;
+}
+
+uint32_t getTicks()
+{
+    uint32_t t;
+
+    // 32 bit value can't be read atomically
+    _DINT();
+    t = ticks;
+    _EINT();
+
+    return t;
+}
+
+// Sleep in low power mode until next tick
+void sleepUntilTick()
+{
+    _DINT();
+    while (!tickElapsed)
+    {
+        // LPM0 keeps SMCLK running so the terminal still receives,
+        // interrupts are enabled together with entering the sleep
+        _BIS_SR(LPM0_bits + GIE);
+        _DINT();
+    }
+    tickElapsed = 0;
+    _EINT();
+}
+
 /*******************************************************************************
  * Hlavni funkce
 *******************************************************************************/
@@ -987,41 +2091,46 @@ int main()
     PEN_PORT_DIR |= PEN_MASK;
 
     uint8_t idle = 0;
-    uint32_t counter = 0;
+    uint32_t lastActivity = 0;
 
     // Wait for ports to set up
     delay_ms(1000);
     initializePen();
     moveToOrigin();
+    // Travel calibrated in an earlier session still applies
+    calibrated = Info_loadTravel(&travelX, &travelY);
+    initializeTicks();
+    print_val1("!INITIALIZED", COMMAND_QUEUE_SIZE);
 
     while (1) {
+        feedTick();
         switch (currentDrawing)
         {
         case DRAWING_FREE:
             switch (currentComplexDrawing)
             {
-            case DRAWING_COMPLEX_DEMO:
-                term_send_str_crlf("Drawing demo.");
-                if(drawDemo(&(currentComplexContext.dc)))
+            case DRAWING_COMPLEX_JOB:
+                if(drawJob(&(currentComplexContext.jc)))
                 {
                     currentDrawing = DRAWING_FREE;
                     currentComplexDrawing = DRAWING_COMPLEX_FREE;
+                    sendEvent("FINISHED", complexSeq);
                 }
                 break;
             case DRAWING_COMPLEX_HILBERT:
-                term_send_str_crlf("Drawing Hilbert.");
                 if(drawHilbert(&(currentComplexContext.hc)))
                 {
                     currentDrawing = DRAWING_FREE;
                     currentComplexDrawing = DRAWING_COMPLEX_FREE;
+                    sendEvent("FINISHED", complexSeq);
                 }
                 break;
             case DRAWING_COMPLEX_FREE:
-                if (counter < IDLE_TIME / DELAY)
-                {           
-                    counter++;
+                if (startQueuedCommand())
+                {
+                    idle = 0;
                 }
-                else if (idle == 0)
+                else if (idle == 0 && getTicks() - lastActivity >= IDLE_TIME / DELAY)
                 {
                     motorsIdle();
                     penUp();
@@ -1035,8 +2144,8 @@ int main()
             {
                 currentDrawing = DRAWING_FREE;
                 idle = 0;
-                counter = 0;
-                term_send_str_crlf("Drawing finished.");
+                lastActivity = getTicks();
+                reportFinished();
             }
             break;
         case DRAWING_CIRCLE:
@@ -1044,15 +2153,55 @@ int main()
             {
                 currentDrawing = DRAWING_FREE;
                 idle = 0;
-                counter = 0;
-                term_send_str_crlf("Drawing finished.");
+                lastActivity = getTicks();
+                reportFinished();
+            }
+            break;
+        case DRAWING_POLYLINE:
+            // Job or queue supplies further vertices as the buffer drains
+            if (currentComplexDrawing == DRAWING_COMPLEX_JOB)
+                feedPolyline(&(currentComplexContext.jc));
+            else
+                feedPolylineFromQueue();
+            if(drawPolylineStep(&(currentContext.pc)) == OPERATION_FINISHED)
+            {
+                currentDrawing = DRAWING_FREE;
+                idle = 0;
+                lastActivity = getTicks();
+                if (currentContext.pc.reportEnd)
+                    reportFinished();
+            }
+            break;
+        case DRAWING_BEZIER:
+            if(drawBezierStep(&(currentContext.bc)) == OPERATION_FINISHED)
+            {
+                currentDrawing = DRAWING_FREE;
+                idle = 0;
+                lastActivity = getTicks();
+                reportFinished();
             }
             break;
         }       
         
+        // Freed queue space is announced at most once per tick
+        if (creditChanged)
+        {
+            creditChanged = 0;
+            sendCredit();
+        }
+
+        // Telemetry follows the timer, not the steps, and is sent only while
+        // something is drawn; the step of this tick is already done
+        if (telemetryInterval != 0 && getTicks() >= nextTelemetry)
+        {
+            nextTelemetry = getTicks() + telemetryInterval;
+            if (currentDrawing != DRAWING_FREE || currentComplexDrawing != DRAWING_COMPLEX_FREE || queueCount != 0)
+                sendTelemetry();
+        }
+
         terminal_idle();
         if (headXArea == IN_DRAWING_AREA || headYArea == IN_DRAWING_AREA)
-            delay_ms(DELAY);
+            sleepUntilTick();
     }
     
     return 0;
@@ -0,0 +1,157 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import hashlib
+import json
+import math
+import os
+from shapes import Arc, Circle, formatCoord
+from clip import distance
+
+# Head closer than this (mm) to interrupted primitive is taken as lying on it
+ON_PATH_TOLERANCE = 1.0
+
+
+def commandsHash(commands):
+    return hashlib.sha1(repr([(id, list(params)) for id, params in commands])).hexdigest()
+
+
+class Checkpoint:
+    """Progress of the drawn job, saved after every finished command,
+    so the job can be resumed after STOP, reset of the device or crash of host."""
+    def __init__(self, path):
+        self.path = path
+        self.state = None
+
+    def begin(self, name):
+        """Job is drawn while it is still being read, its progress is kept
+        and saved once all its commands are known."""
+        self.state = {'name': name, 'hash': None, 'count': None, 'done': -1, 'position': None}
+
+    def start(self, name, commands):
+        done = -1
+        if self.state is not None and self.state['name'] == name and self.state['hash'] is None:
+            done = self.state['done']
+        self.state = {'name': name, 'hash': commandsHash(commands), 'count': len(commands),
+                      'done': done, 'position': None}
+        if done + 1 >= len(commands):
+            self.finish()
+        else:
+            self.save()
+
+    def completed(self, index):
+        if self.state is None or index <= self.state['done']:
+            return
+        self.state['done'] = index
+        self.state['position'] = None
+        if self.state['count'] is None:
+            return
+        if index + 1 >= self.state['count']:
+            self.finish()
+        else:
+            self.save()
+
+    def stopped(self, position, cutting):
+        if self.state is not None:
+            # Head moving to start of the command with pen up is not on drawn
+            # part of it, whole command is drawn again then
+            self.state['position'] = position if cutting else None
+            if self.state['count'] is not None:
+                self.save()
+
+    def finish(self):
+        self.state = None
+        if os.path.exists(self.path):
+            os.remove(self.path)
+
+    def save(self):
+        # Write whole file first, so crash leaves either old or new progress
+        temporary = self.path + '.tmp'
+        with open(temporary, 'w') as f:
+            json.dump(self.state, f)
+        if os.name == 'nt' and os.path.exists(self.path):
+            os.remove(self.path)
+        os.rename(temporary, self.path)
+
+    def load(self):
+        if not os.path.exists(self.path):
+            return None
+        with open(self.path) as f:
+            self.state = json.load(f)
+        return self.state
+
+
+def toPoint(params, offset=0):
+    return (float(params[offset]), float(params[offset + 1]))
+
+
+def onSegment(position, start, end):
+    """Return position projected onto segment, or None if it is not close to it."""
+    dx, dy = end[0] - start[0], end[1] - start[1]
+    length = dx * dx + dy * dy
+    t = 0.0
+    if length > 0:
+        t = max(0.0, min(1.0, ((position[0] - start[0]) * dx + (position[1] - start[1]) * dy) / length))
+    point = (start[0] + t * dx, start[1] + t * dy)
+    if distance(point, position) > ON_PATH_TOLERANCE:
+        return None
+    return point
+
+
+def pointParams(point):
+    return [formatCoord(point[0]), formatCoord(point[1])]
+
+
+def vertexOf(command):
+    id, params = command
+    if id in ('POLYLINE', 'VERTEX'):
+        return toPoint(params)
+    return None
+
+
+def resumeCommands(commands, done, position=None):
+    """Commands drawing the rest of a job, each paired with index of the job
+    command that is finished with it. Interrupted line, circle or polyline
+    segment continues from the head position when the head lies on it,
+    position is given only when the pen was down on the interrupted command."""
+    index = done + 1
+    if index >= len(commands):
+        return []
+
+    id, params = commands[index]
+    resumed = []
+
+    if id == 'LINE':
+        start, end = toPoint(params), toPoint(params, 2)
+        point = onSegment(position, start, end) if position else None
+        if point:
+            params = pointParams(point) + pointParams(end)
+        resumed.append(((id, params), index))
+
+    elif id == 'CIRCLE':
+        center, radius = toPoint(params), float(params[2])
+        if position and abs(distance(position, center) - radius) <= ON_PATH_TOLERANCE:
+            # Device draws clockwise from the start, the rest goes
+            # counterclockwise from the start to the head
+            octant = int(params[3]) if len(params) > 3 else 0
+            angle = math.degrees(math.atan2(position[1] - center[1], position[0] - center[0]))
+            pieces = Arc(center, radius, Circle(center, radius, octant).getStartAngle(), angle).getCommands()
+            resumed.extend((piece, index - 1) for piece in pieces[:-1])
+            resumed.append((pieces[-1], index))
+        else:
+            resumed.append(((id, params), index))
+
+    elif id == 'VERTEX':
+        # Polyline is started again at the last reached vertex or at the head
+        start, end = vertexOf(commands[index - 1]), toPoint(params)
+        point = onSegment(position, start, end) if position and start else None
+        resumed.append((('POLYLINE', pointParams(point or start or end)), index - 1))
+        resumed.append(((id, params), index))
+
+    elif id == 'POLYEND':
+        # Whole polyline is drawn already
+        pass
+
+    else:
+        resumed.append(((id, params), index))
+
+    return resumed + [(commands[i], i) for i in range(index + 1, len(commands))]
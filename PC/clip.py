@@ -0,0 +1,176 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import math
+from shapes import Line, Circle, Arc, Bezier, Polyline
+
+
+class WorkArea:
+    def __init__(self, minX, minY, maxX, maxY):
+        self.minX = minX
+        self.minY = minY
+        self.maxX = maxX
+        self.maxY = maxY
+
+    def contains(self, point):
+        return self.minX <= point[0] <= self.maxX and self.minY <= point[1] <= self.maxY
+
+    def __str__(self):
+        return '%g %g %g %g' % (self.minX, self.minY, self.maxX, self.maxY)
+
+
+def distance(a, b):
+    return math.hypot(b[0] - a[0], b[1] - a[1])
+
+
+def clipSegment(start, end, area):
+    """Liang-Barsky clipping, returns visible part of segment or None."""
+    dx = end[0] - start[0]
+    dy = end[1] - start[1]
+    t0, t1 = 0.0, 1.0
+
+    for p, q in ((-dx, start[0] - area.minX), (dx, area.maxX - start[0]),
+                 (-dy, start[1] - area.minY), (dy, area.maxY - start[1])):
+        if p == 0:
+            if q < 0:
+                return None
+        else:
+            t = float(q) / p
+            if p < 0:
+                t0 = max(t0, t)
+            else:
+                t1 = min(t1, t)
+
+    if t0 > t1:
+        return None
+
+    return ((start[0] + t0 * dx, start[1] + t0 * dy),
+            (start[0] + t1 * dx, start[1] + t1 * dy))
+
+
+def clipPolyline(points, area):
+    """Split polyline into parts lying inside of area."""
+    parts = []
+    current = []
+
+    for start, end in zip(points[:-1], points[1:]):
+        segment = clipSegment(start, end, area)
+        if segment is None:
+            continue
+
+        if current and distance(current[-1], segment[0]) < 1e-9:
+            current.append(segment[1])
+        else:
+            if len(current) > 1:
+                parts.append(current)
+            current = [segment[0], segment[1]]
+
+    if len(current) > 1:
+        parts.append(current)
+
+    return parts
+
+
+def clipArc(center, radius, startAngle, sweep, area):
+    """Return visible (startAngle, sweep) pairs of arc, angles in degrees."""
+    cx, cy = center
+
+    # Circle of no size is just its center
+    if radius == 0:
+        return [(startAngle, sweep)] if area.contains(center) else []
+
+    # Angles where the circle crosses lines of the rectangle
+    crossings = []
+    for value, horizontal in ((area.minX, False), (area.maxX, False), (area.minY, True), (area.maxY, True)):
+        offset = (value - cy if horizontal else value - cx) / float(radius)
+        if abs(offset) > 1:
+            continue
+        base = math.degrees(math.asin(offset) if horizontal else math.acos(offset))
+        for angle in ((base, 180 - base) if horizontal else (base, -base)):
+            relative = (angle - startAngle) % 360.0
+            if 0 < relative < sweep:
+                crossings.append(relative)
+
+    bounds = [0.0] + sorted(crossings) + [sweep]
+    visible = []
+    for a, b in zip(bounds[:-1], bounds[1:]):
+        if b - a < 1e-9:
+            continue
+        middle = math.radians(startAngle + (a + b) / 2.0)
+        if not area.contains((cx + math.cos(middle) * radius, cy + math.sin(middle) * radius)):
+            continue
+        if visible and abs(visible[-1][0] + visible[-1][1] - (startAngle + a)) < 1e-9:
+            visible[-1] = (visible[-1][0], visible[-1][1] + b - a)
+        else:
+            visible.append((startAngle + a, b - a))
+
+    # Visible part of full circle may wrap around its start
+    if sweep >= 360.0 and len(visible) > 1 and visible[0][0] == startAngle and \
+            abs(visible[-1][0] + visible[-1][1] - startAngle - 360.0) < 1e-9:
+        last = visible.pop()
+        visible[0] = (last[0], last[1] + visible[0][1])
+
+    return visible
+
+
+def flattenBezier(points, count=16):
+    result = []
+    for i in range(count + 1):
+        t = float(i) / count
+        u = 1 - t
+        result.append(tuple(u * u * u * points[0][j] + 3 * u * u * t * points[1][j] +
+                            3 * u * t * t * points[2][j] + t * t * t * points[3][j] for j in range(2)))
+    return result
+
+
+def polylineLength(points):
+    return sum(distance(a, b) for a, b in zip(points[:-1], points[1:]))
+
+
+def clipShape(shape, area):
+    """Return list of visible shapes and length of dropped geometry."""
+    if isinstance(shape, Line):
+        segment = clipSegment(shape.start, shape.end, area)
+        if segment is None:
+            return [], distance(shape.start, shape.end)
+        return [Line(segment[0], segment[1])], distance(shape.start, shape.end) - distance(segment[0], segment[1])
+
+    if isinstance(shape, Polyline):
+        vertices = shape.getVertices()
+        parts = clipPolyline(vertices, area)
+        if len(parts) == 1 and len(parts[0]) == len(vertices):
+            # Nothing was clipped, keep it closed
+            return [shape], 0.0
+        kept = sum(polylineLength(part) for part in parts)
+        return [Polyline(part) for part in parts], polylineLength(vertices) - kept
+
+    if isinstance(shape, (Circle, Arc)):
+        if isinstance(shape, Circle):
+            startAngle, sweep = shape.getStartAngle(), 360.0
+        else:
+            startAngle, sweep = shape.startAngle, shape.getSweep()
+        visible = clipArc(shape.center, shape.radius, startAngle, sweep, area)
+        total = math.radians(sweep) * shape.radius
+        if len(visible) == 1 and visible[0][1] >= sweep:
+            return [shape], 0.0
+        arcs = [Arc(shape.center, shape.radius, a, a + s) for a, s in visible]
+        return arcs, total - sum(math.radians(s) * shape.radius for a, s in visible)
+
+    if isinstance(shape, Bezier):
+        if all(area.contains(p) for p in shape.points):
+            return [shape], 0.0
+        return clipShape(Polyline(flattenBezier(shape.points)), area)
+
+    return [shape], 0.0
+
+
+def clipShapes(shapes, area):
+    """Clip all shapes to work area, return visible shapes and dropped length in millimeters."""
+    result = []
+    dropped = 0.0
+
+    for shape in shapes:
+        visible, length = clipShape(shape, area)
+        result.extend(visible)
+        dropped += length
+
+    return result, dropped
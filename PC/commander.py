@@ -1,26 +1,48 @@
 # !/usr/bin/env python
 __author__ = 'Ivan'
 
-import threading
 import sys
-import Queue
+import os
+import select
 import time
+import multiprocessing
 
 import fitkit.fitkit as fitkit
 from dxf_input import DxfInput
+from clip import WorkArea
+from transform import Transform
+from preprocess import Settings, preprocess
+from checkpoint import Checkpoint, commandsHash, resumeCommands
+from progress import Progress, formatDuration
+from shapes import Arc
+from estimate import FEED_MAX
+
+# Telemetry intervals in ms the device accepts, 0 turns it off
+TELEMETRY_MIN_MS = 100
+TELEMETRY_MAX_MS = 60000
+
+
+def validTelemetry(interval):
+    return interval == 0 or TELEMETRY_MIN_MS <= interval <= TELEMETRY_MAX_MS
+
 
 def print_error(message):
     sys.stderr.write(message + '\n')
 
 
 class Message:
-    def __init__(self, command, params=None):
+    def __init__(self, command, params=None, seq=None):
         self.command = command
         self.params = params
+        self.seq = seq
 
     def __str__(self):
         res = ''
 
+        # Sequence number ties the events of device to the command
+        if self.seq is not None:
+            res += '@%d ' % self.seq
+
         # Append command
         res += self.command
 
@@ -34,23 +56,46 @@ class Message:
 
 
 class InitializedReply:
-    def __init__(self):
-        pass
+    def __init__(self, credit):
+        self.credit = credit
 
 
 class DrawingStartedReply:
-    def __init__(self):
-        pass
+    def __init__(self, seq):
+        self.seq = seq
 
 
 class DrawingFinishedReply:
-    def __init__(self):
-        pass
+    def __init__(self, seq):
+        self.seq = seq
 
 
-class ComplexDrawingFinishedReply:
-    def __init__(self):
-        pass
+class AcceptedReply:
+    def __init__(self, seq, credit):
+        self.seq = seq
+        self.credit = credit
+
+
+class CreditReply:
+    def __init__(self, credit):
+        self.credit = credit
+
+
+class PositionReply:
+    def __init__(self, seq, x, y, cutting=0):
+        self.seq = seq
+        # Device reports position in internal steps of 0.1 mm
+        self.position = (x / 10.0, y / 10.0)
+        # Pen was down on the interrupted command, not just moving to its start
+        self.cutting = bool(cutting)
+
+
+class TelemetryReply:
+    def __init__(self, seq, x, y, queued):
+        self.seq = seq
+        self.position = (x / 10.0, y / 10.0)
+        self.queued = queued
+
 
 class DebugReply:
     def __init__(self, debug_text):
@@ -75,7 +120,8 @@ class QuitReply:
 
 
 class ErrorReply:
-    def __init__(self, error_text):
+    def __init__(self, seq, error_text):
+        self.seq = seq
         self.errorText = error_text
 
     def __str__(self):
@@ -87,16 +133,6 @@ class ErrorReply:
         return res
 
 
-class QuitNotification:
-    def __init__(self):
-        pass
-
-
-class ReplyNotification:
-    def __init__(self, reply):
-        self.reply = reply
-
-
 class MessageNotifiaction:
     def __init__(self, msgStr, id):
         self.id = id
@@ -109,13 +145,20 @@ class InitializeCommand:
 
 
 class DrawingCommand:
+    """Queued by device, sent ahead while device reports free space in its queue."""
+    def __init__(self):
+        pass
+
+
+class ControlCommand:
+    """Executed by device alone, sent only when nothing else is in progress."""
     def __init__(self):
         pass
 
 
-class ComplexDrawingCommand:
+class ComplexDrawingCommand(ControlCommand):
     def __init__(self):
-        self.started = False
+        ControlCommand.__init__(self)
 
 
 class QuitCommand:
@@ -123,6 +166,47 @@ class QuitCommand:
         pass
 
 
+class InputReader:
+    """Non-blocking reading of lines from standard input."""
+    def __init__(self):
+        self.buffer = ''
+        self.closed = False
+
+    def readLines(self):
+        lines = []
+
+        if os.name == 'nt':
+            import msvcrt
+            while msvcrt.kbhit():
+                ch = msvcrt.getwche()
+                if ch == '\x1a':
+                    self.closed = True
+                elif ch == '\r':
+                    sys.stdout.write('\n')
+                    lines.append(self.buffer)
+                    self.buffer = ''
+                else:
+                    self.buffer += ch
+            return lines
+
+        while select.select([sys.stdin], [], [], 0)[0]:
+            line = sys.stdin.readline()
+            if not line:
+                self.closed = True
+                break
+            lines.append(line.rstrip('\r\n'))
+
+        return lines
+
+
+def openChannel(device):
+    ch = device['b']
+    ret = ch.open()
+    if ret != fitkit.IOChannel.Ok:
+        raise Exception("Can't open")
+    return ch
+
+
 class FitKitClient:
     writingMode = 1
     listeningMode = 2
@@ -132,21 +216,68 @@ class FitKitClient:
         self.mode = 0
         self.replyTimeout = 10
         self.drawingTimeout = 1000
-        self.issuedCommand = None
-
-        self.mainQueue = Queue.Queue()
-
-        self.inputQueue = Queue.Queue()
-        self.inputThread = threading.Thread(None, self.input)
-        self.inputThread.daemon = True
-
-        self.sendQueue = Queue.Queue()
-        self.sendThread = threading.Thread(None, self.send)
-
-        self.listenQueue = Queue.Queue()
-        self.listeningThread = threading.Thread(None, self.listen)
+        # Device is polled with this timeout (ms) while nothing else happens
+        self.pollTimeout = 20
+        self.settings = Settings()
+        # Large drawings are preprocessed by this many processes
+        self.workers = multiprocessing.cpu_count()
+        # Progress of drawn file, for resuming it
+        self.checkpoint = Checkpoint('plotter.checkpoint')
+        # Device reports the head with this period (ms) while drawing, 0 turns it off
+        self.telemetryInterval = 500
+        # Progress of drawn file, for its progress line
+        self.progress = None
+        self.progressShown = False
+
+        self.running = False
+        self.commands = []
+        self.initialized = False
+        self.deadline = None
+        # Commands sent to device and not finished yet, by sequence number
+        self.inflight = {}
+        self.nextSeq = 1
+        # Free space in device queue as last reported, and commands sent since then
+        self.credit = 0
+        self.unacked = 0
+        # Device reads one line at a time, next one is sent after it is accepted
+        self.maxUnacked = 1
+        self.textBuffer = ''
+        self.inputReader = InputReader()
+
+        self.replyHandlers = {
+            InitializedReply: self.onInitialized,
+            DrawingStartedReply: self.onDrawingStarted,
+            DrawingFinishedReply: self.onDrawingFinished,
+            AcceptedReply: self.onAccepted,
+            CreditReply: self.onCredit,
+            PositionReply: self.onPosition,
+            TelemetryReply: self.onTelemetry,
+            ErrorReply: self.onError,
+            QuitReply: self.onQuit,
+        }
 
         self.comChannel = None
+        # Prefix of reports when more devices are driven together
+        self.name = None
+        # Serial traffic is logged here, when set
+        self.recorder = None
+
+    def report(self, text):
+        if self.name:
+            text = '%s: %s' % (self.name, text)
+        if self.progressShown:
+            # Progress line is kept at the bottom, reports go above it
+            sys.stdout.write('\n')
+            self.progressShown = False
+        print text
+
+    def showProgress(self, text):
+        if self.name:
+            text = '%s: %s' % (self.name, text)
+        # Line is rewritten in place, padding clears the longer previous one
+        sys.stdout.write('\r%-79s' % text)
+        sys.stdout.flush()
+        self.progressShown = True
 
     def run(self, mode):
         self.mode = mode
@@ -164,62 +295,77 @@ class FitKitClient:
         print "VID: %04X  PID: %04X  SN: %s DECR: %s" % (device.vid(), device.pid(),
                                                          device['b'].serial(), device['b'].product())
 
-        ch = device['b']
-        assert isinstance(ch, fitkit.IOChannel)
-        ret = ch.open()
-        if ret != fitkit.IOChannel.Ok:
-            raise Exception("Can't open")
-
-        ch.resetMCU()
-
-        self.comChannel = ch
+        self.attach(openChannel(device))
+        self.loop()
 
+    def attach(self, channel):
+        # Device starts homing after reset and reports when it is ready
+        channel.resetMCU()
+        if self.recorder:
+            self.recorder.reset()
+        self.comChannel = channel
+        self.running = True
         self.queueToSend(Message(''), InitializeCommand())
 
-        try:
-            self.inputThread.start()
-            self.sendThread.start()
-            self.listeningThread.start()
-        except Exception, e:
-            print_error('Could not start all threads.')
-            return
-
-        # Application is running while there is any input
-        # and while the listening thread is alive
-        while True:
-            inputItem = None
-            try:
-                inputItem = self.mainQueue.get(True, 0.1)
-            except Queue.Empty, e:
-                pass
+    def isIdle(self):
+        return self.initialized and not self.commands and not self.inflight
 
-            if isinstance(inputItem, QuitNotification):
+    def loop(self):
+        # Single thread serves both the user and the device, replies are
+        # handled as soon as they arrive and the next command goes out at once.
+        while self.running:
+            self.pollInput()
+            if not self.running:
                 break
+            self.pollDevice()
+            self.checkTimeout()
 
-    def input(self):
-        while True:
-            try:
-                inputStr = raw_input()
-            except (KeyboardInterrupt, EOFError):
-                self.mainQueue.put(QuitNotification())
-                return
-
-            while True:
-                try:
-                    queueItem = self.inputQueue.get_nowait()
-                    if isinstance(queueItem, QuitNotification):
-                        return
-                except Queue.Empty:
-                    break
-
+    def pollInput(self):
+        for inputStr in self.inputReader.readLines():
             if (self.mode == FitKitClient.writingMode) or (self.mode == FitKitClient.fullMode):
                 if not self.processInput(inputStr):
                     # Quit command was issued
-                    self.mainQueue.put(QuitNotification())
+                    self.running = False
                     return
             else:
                 print_error("Shhhh! You're listening.")
 
+        if self.inputReader.closed:
+            self.running = False
+
+    def pollDevice(self, timeout=None):
+        # Wait for first character, then take everything that is available
+        if timeout is None:
+            timeout = self.pollTimeout
+        received = False
+        while True:
+            try:
+                data = self.comChannel.read(1, timeout)
+            except RuntimeError, e: #read terminated
+                print "Exception", e
+                self.running = False
+                return received
+
+            if not data:
+                break
+
+            self.textBuffer += data
+            timeout = 0
+            received = True
+
+            if data == '\n':
+                self.processReceived()
+
+        return received
+
+    def awaitReply(self):
+        return bool(self.inflight) or not self.initialized
+
+    def checkTimeout(self):
+        if self.awaitReply() and self.deadline is not None and time.time() > self.deadline:
+            print_error('Server did not reply in time.')
+            self.running = False
+
     def unsplit(self, parts):
         return ' '.join(parts)
 
@@ -237,25 +383,115 @@ class FitKitClient:
             parts = text.split(' ')
             # Remove slash (already checked)
             command = parts[0]
-            if command == 'move' and len(parts) == 3:
-                self.queueToSend(Message('MOVE', parts[1:]), DrawingCommand())
+            if command == 'stop' and len(parts) == 1:
+                # Goes ahead of everything waiting to be sent
+                del self.commands[:]
+                self.queueToSend(Message('STOP'), ControlCommand(), True)
             elif command == 'line' and len(parts) == 5:
                 self.queueToSend(Message('LINE', parts[1:]), DrawingCommand())
-            elif command == 'arc' and len(parts) == 4:
-                self.queueToSend(Message('ARC', parts[1:]), DrawingCommand())
-            elif command == 'circle' and len(parts) == 4:
+            elif command == 'arc' and len(parts) == 6:
+                # Device has no arcs, they are drawn as Bezier curves
+                try:
+                    values = [float(part) for part in parts[1:]]
+                except ValueError:
+                    print_error('Invalid arc.')
+                    return
+                for id, params in Arc(values[0:2], values[2], values[3], values[4]).getCommands():
+                    self.queueToSend(Message(id, params), DrawingCommand())
+            elif command == 'circle' and len(parts) in (4, 5):
                 self.queueToSend(Message('CIRCLE', parts[1:]), DrawingCommand())
+            elif command == 'polyline' and len(parts) >= 5 and len(parts) % 2 == 1:
+                self.queueToSend(Message('POLYLINE', parts[1:3]), DrawingCommand())
+                for i in range(3, len(parts), 2):
+                    self.queueToSend(Message('VERTEX', parts[i:i + 2]), DrawingCommand())
+                self.queueToSend(Message('POLYEND'), DrawingCommand())
+            elif command == 'bezier' and len(parts) == 9:
+                self.queueToSend(Message('BEZIER', parts[1:]), DrawingCommand())
+            elif command == 'home' and len(parts) == 1:
+                self.queueToSend(Message('HOME'), ControlCommand())
+            elif command == 'stepmode' and len(parts) == 3 and parts[1] in ('move', 'draw') and parts[2] in ('full', 'half'):
+                self.queueToSend(Message('STEPMODE', parts[1:]), ControlCommand())
+                if parts[1] == 'move':
+                    self.settings.timeModel.stepModeMove = parts[2]
+                else:
+                    self.settings.timeModel.stepModeDraw = parts[2]
+            elif command == 'calibrate' and len(parts) == 1:
+                self.queueToSend(Message('CALIBRATE'), ControlCommand())
             elif command == 'demo' and len(parts) == 1:
                 self.queueToSend(Message('DEMO', parts[1:]), ComplexDrawingCommand())
             elif command == 'hilbert' and len(parts) == 2:
                 self.queueToSend(Message('HILBERT', parts[1:]), ComplexDrawingCommand())
             elif command == 'read' and len(parts) == 2:
                 try:
-                    dxfInput = DxfInput(parts[1])
-                    for id, params in dxfInput.getCommands():
-                        self.queueToSend(Message(id, params), DrawingCommand())
+                    self.drawFile(parts[1])
                 except:
                     print_error('Error drawing the file')
+            elif command == 'resume' and len(parts) == 1:
+                try:
+                    self.resumeDrawing()
+                except:
+                    print_error('Error resuming the file')
+            elif command == 'feed' and len(parts) == 2:
+                try:
+                    self.setFeed(int(parts[1]) if parts[1] != 'off' else 0)
+                except ValueError:
+                    print_error('Invalid feed rate.')
+            elif command == 'telemetry' and len(parts) == 2:
+                try:
+                    self.setTelemetry(int(parts[1]))
+                except ValueError:
+                    print_error('Invalid telemetry interval.')
+            elif command == 'where' and len(parts) == 1:
+                self.queueToSend(Message('WHERE'), ControlCommand())
+            elif command == 'store' and len(parts) == 3:
+                try:
+                    commands = self.readDrawing(parts[2])
+                    # Commands compiled into the job finish as soon as they are stored
+                    self.queueToSend(Message('STORE', parts[1:2]), ControlCommand())
+                    # Job is drawn at the feed rate it was prepared for, no limit too,
+                    # whatever the host sets when it is run
+                    self.queueToSend(Message('FEED', [str(self.settings.timeModel.feed or 0)]), DrawingCommand())
+                    for id, params in commands:
+                        self.queueToSend(Message(id, params), DrawingCommand())
+                    self.queueToSend(Message('ENDSTORE'), ControlCommand())
+                except:
+                    print_error('Error storing the file')
+            elif command == 'run' and len(parts) == 2:
+                self.queueToSend(Message('RUN', parts[1:]), ComplexDrawingCommand())
+            elif command == 'area' and len(parts) == 5:
+                try:
+                    self.settings.workArea = WorkArea(*[float(part) for part in parts[1:]])
+                except ValueError:
+                    print_error('Invalid work area.')
+            elif command == 'transform' and len(parts) == 5:
+                try:
+                    self.settings.transform = Transform(*[float(part) for part in parts[1:]])
+                except ValueError:
+                    print_error('Invalid transform.')
+            elif command == 'hatch' and len(parts) == 2 and parts[1] == 'off':
+                self.settings.hatch = None
+            elif command == 'hatch' and len(parts) == 3:
+                try:
+                    self.settings.hatch = (float(parts[1]), float(parts[2]))
+                except ValueError:
+                    print_error('Invalid hatch.')
+            elif command == 'dedup' and len(parts) == 2:
+                try:
+                    self.settings.dedup = float(parts[1]) if parts[1] != 'off' else None
+                except ValueError:
+                    print_error('Invalid deduplication tolerance.')
+            elif command == 'simplify' and len(parts) == 2:
+                try:
+                    self.settings.simplify = float(parts[1]) if parts[1] != 'off' else None
+                except ValueError:
+                    print_error('Invalid simplification tolerance.')
+            elif command == 'fit' and len(parts) == 2 and parts[1] in ('on', 'off'):
+                self.settings.fitToArea = parts[1] == 'on'
+            elif command == 'orient' and len(parts) == 2:
+                try:
+                    self.settings.orientStep = float(parts[1]) or None
+                except ValueError:
+                    print_error('Invalid orientation step.')
             elif command == 'quit' and len(parts) == 1:
                 return False
             else:
@@ -263,19 +499,84 @@ class FitKitClient:
 
         return True
 
+    def readDrawing(self, filename):
+        commands = []
+        for part in self.readDrawingParts(filename):
+            commands.extend(part)
+        return commands
+
+    def readDrawingParts(self, filename):
+        return preprocess(DxfInput(filename).getShapes(), self.settings, self.workers)
+
+    def drawFile(self, filename):
+        # Device draws first parts while the rest is still being prepared
+        self.checkpoint.begin(filename)
+        self.progress = Progress(self.settings.timeModel)
+        commands = []
+        for part in self.readDrawingParts(filename):
+            self.queueJob(part, range(len(commands), len(commands) + len(part)))
+            commands.extend(part)
+            self.pollDevice(0)
+        self.checkpoint.start(filename, commands)
+
+    def queueJob(self, commands, indexes):
+        for (id, params), index in zip(commands, indexes):
+            msg = Message(id, params)
+            # Finished command moves the checkpoint
+            msg.jobIndex = index
+            if self.progress:
+                msg.progressIndex = self.progress.add([(id, params)])
+            self.queueToSend(msg, DrawingCommand())
+
+    def resumeDrawing(self):
+        state = self.checkpoint.load()
+        if state is None:
+            print_error('Nothing to resume.')
+            return
+
+        commands = self.readDrawing(state['name'])
+        if commandsHash(commands) != state['hash']:
+            print_error('Drawing or its settings changed since it was interrupted.')
+            return
+
+        position = tuple(state['position']) if state['position'] else None
+        resumed = resumeCommands(commands, state['done'], position)
+        if not resumed:
+            self.checkpoint.finish()
+            return
+
+        self.report('Resuming %s at command %d of %d' % (state['name'], state['done'] + 2, len(commands)))
+        # Head position is lost with reset, device homes before it continues
+        self.queueToSend(Message('HOME'), ControlCommand())
+        self.progress = Progress(self.settings.timeModel)
+        self.queueJob([command for command, index in resumed], [index for command, index in resumed])
+
+    def setFeed(self, feed):
+        # Rate the device would reject must not get into the time model
+        if not 0 <= feed <= FEED_MAX:
+            raise ValueError('Feed rate out of range')
+        # Device queues it with drawings, it applies to those sent after it
+        self.settings.timeModel.feed = feed or None
+        self.queueToSend(Message('FEED', [str(feed)]), DrawingCommand())
+
+    def setTelemetry(self, interval):
+        # Interval is sent again after reset, the device must be able to take it
+        if not validTelemetry(interval):
+            raise ValueError('Telemetry interval out of range')
+        self.telemetryInterval = interval
+        if self.initialized:
+            # Device takes it at once, even while drawing
+            self.queueToSend(Message('TELEMETRY', [str(interval)]), ControlCommand(), True)
+
     def queueClose(self):
-        self.mainQueue.put(QuitNotification())
+        self.running = False
 
     def close(self):
-        self.queueToSend(Message('QUIT'), QuitCommand())
+        if self.comChannel is None:
+            return
 
-        self.inputQueue.put(QuitNotification())
-        if self.sendThread.isAlive():
-            self.sendQueue.put(QuitNotification())
-            self.sendThread.join()
-        if self.listeningThread.isAlive():
-            self.listenQueue.put(QuitNotification())
-            self.listeningThread.join()
+        self.inflight.clear()
+        self.queueToSend(Message('QUIT'))
 
         # reset MCU
         self.comChannel.resetMcu()
@@ -284,205 +585,264 @@ class FitKitClient:
 
         self.comChannel.close()
 
-    def queueToSend(self, msg, id=None):
-        if isinstance(msg, Message):
-            msgStr = str(msg)
+    def queueToSend(self, msg, id=None, urgent=False):
+        notification = MessageNotifiaction(msg, id)
+        if urgent:
+            # Sent regardless of commands in progress
+            self.sendCommand(notification)
         else:
-            msgStr = msg + '\r\n'
-
-        self.sendQueue.put(MessageNotifiaction(msgStr, id))
+            self.commands.append(notification)
+        self.sendPending()
 
     def checkCommand(self, command):
         return True
 
-    def send(self):
-        commands = []
-        awaitReply = False
-        timeout = 0
-        while True:
-            if awaitReply:
-                start = time.time()
-                try:
-                    queueItem = self.sendQueue.get(True, timeout)
-                except Queue.Empty:
-                    print_error('Server did not reply in time.')
-                    self.mainQueue.put(QuitNotification())
-                    return
-
-                # Subtract the seconds passed
-                timeout -= (time.time() - start)
-            else:
-                queueItem = self.sendQueue.get(True)
-
-            if isinstance(queueItem, QuitNotification):
-                return
-
-            elif isinstance(queueItem, ReplyNotification):
-                if isinstance(queueItem.reply, DrawingStartedReply):
-                    if isinstance(self.issuedCommand, DrawingCommand):
-                        print ("Drawing has started")
-                        timeout = self.drawingTimeout
-
-                    if isinstance(self.issuedCommand, ComplexDrawingCommand) and not self.issuedCommand.started:
-                        if not self.issuedCommand.started:
-                            print ("Complex drawing has started")
-                            self.issuedCommand.started = True
-
-                        timeout = self.drawingTimeout
-
-                elif isinstance(queueItem.reply, DrawingFinishedReply):
-                    if isinstance(self.issuedCommand, DrawingCommand):
-                        print ("Drawing has finished")
-                        self.issuedCommand = None
-                        awaitReply = False
-
-                elif isinstance(queueItem.reply, ComplexDrawingFinishedReply):
-                    if isinstance(self.issuedCommand, ComplexDrawingCommand):
-                        print ("Complex drawing has finished")
-                        self.issuedCommand = None
-                        awaitReply = False
-
-                elif isinstance(queueItem.reply, InitializedReply):
-                    if isinstance(self.issuedCommand, InitializeCommand):
-                        print ("FITkit initialized")
-                        self.issuedCommand = None
-                        awaitReply = False
-
-                elif isinstance(queueItem.reply, QuitReply):
-                    self.mainQueue.put(QuitNotification)
-                    return
-
-            elif isinstance(queueItem, MessageNotifiaction):
-                commands.append(queueItem)
-
-            # Do not send next command if still waiting for reply
-            while commands and not awaitReply:
-                command = commands.pop(0)
-                assert isinstance(command, MessageNotifiaction)
-                if not self.checkCommand(command):
-                    continue
-                commandStr = command.messageString
-                if command.id:
-                    self.issuedCommand = command.id
-                    awaitReply = True
-                    if isinstance(self.issuedCommand, InitializeCommand):
-                        timeout = self.drawingTimeout
-                    else:
-                        timeout = self.replyTimeout
-                else:
-                    awaitReply = False
-
-                try:
-                    for ch in commandStr:
-                        self.comChannel.write(ch, 1)
-
-                except:
-                    print_error('Error while writing to FITkit')
-                    self.mainQueue.put(QuitNotification())
-                    return
-
-
-    def listen(self):
-        messages = []
-        textBuffer = ''
-        while True:
-            try:
-                queueItem = self.inputQueue.get_nowait()
-                if isinstance(queueItem, QuitNotification):
-                    return
-            except Queue.Empty:
-                pass
-
-            try:
-                data = self.comChannel.read(1, 200)
-                if data is not None:
-                    textBuffer += data
-
-            except RuntimeError, e: #read terminated
-                print "Exception",e
-                self.mainQueue.put(QuitNotification())
-                return
-
-            try:
-                # Parse received data
-                lines = textBuffer.split('\r\n')
-                for line in lines[:-1]:
-                    currentPart = 0
-
-                    line = line.strip(' ')
-
-                    # Skip empty lines
-                    if not line:
-                        continue
-
-                    # Ignore line that repeats input
-                    if line[0] == '>':
-                        line = line[1:]
-
-                    parts = line.split(' ')
-
-                    # Extract command text / code
-                    command = ''
-                    if parts[currentPart] and parts[currentPart][0] == '!':
-                        command = parts[currentPart][1:]
-                        currentPart += 1
-
-                    # Extract parameters (if any)
-                    params = []
-                    while currentPart < len(parts):
-                        # Work with non empty parts
-                        if parts[currentPart]:
-                            # Watch for ':' that will mark trailing parameter
-                            if parts[currentPart][0] == ':':
-                                # Remove colon ':' from first part
-                                trailingParam = parts[currentPart][1:]
-                                currentPart += 1
-
-                                # Now we need to rebuild the string from rest of parts
-                                if currentPart < len(parts):
-                                    trailingParam += ' ' + self.unsplit(parts[currentPart:])
+    def setTimeout(self, timeout):
+        self.deadline = time.time() + timeout
+
+    def canSend(self, command):
+        if isinstance(command.id, InitializeCommand) or command.id is None:
+            return True
+        if not self.initialized:
+            return False
+
+        if isinstance(command.id, DrawingCommand):
+            # Drawings may follow each other, but not a control command
+            for issued in self.inflight.values():
+                if isinstance(issued.id, ControlCommand):
+                    return False
+            return self.unacked < self.maxUnacked and self.credit - self.unacked > 0
+
+        # Control command waits for everything to finish
+        return not self.inflight
+
+    def sendPending(self):
+        while self.running and self.commands and self.canSend(self.commands[0]):
+            command = self.commands.pop(0)
+            assert isinstance(command, MessageNotifiaction)
+            if self.checkCommand(command):
+                self.sendCommand(command)
+
+    def sendCommand(self, command):
+        msg = command.messageString
+        if command.id is None or isinstance(command.id, InitializeCommand):
+            commandStr = str(msg) if isinstance(msg, Message) else msg + '\r\n'
+            if isinstance(command.id, InitializeCommand):
+                # Device homes itself before it is initialized
+                self.setTimeout(self.drawingTimeout)
+        else:
+            if not self.inflight:
+                self.setTimeout(self.replyTimeout)
+            msg.seq = self.nextSeq
+            self.nextSeq += 1
+            self.inflight[msg.seq] = command
+            self.unacked += 1
+            commandStr = str(msg)
 
-                                params.append(trailingParam)
-                                break
+        if self.recorder:
+            self.recorder.sent(commandStr)
 
-                            params.append(parts[currentPart])
-                        currentPart += 1
+        try:
+            for ch in commandStr:
+                self.comChannel.write(ch, 1)
+
+        except:
+            print_error('Error while writing to FITkit')
+            self.running = False
+
+    def processReceived(self):
+        # Parse received data
+        lines = self.textBuffer.split('\r\n')
+        for line in lines[:-1]:
+            if self.recorder:
+                self.recorder.received(line)
+            msg = self.parseLine(line)
+            if msg is not None and not self.process(msg):
+                self.running = False
+
+        # Save the rest of unprocessed data
+        self.textBuffer = lines[-1]
+
+    def parseLine(self, line):
+        currentPart = 0
+
+        line = line.strip(' ')
+
+        # Skip empty lines
+        if not line:
+            return None
+
+        # Ignore line that repeats input
+        if line[0] == '>':
+            line = line[1:]
+
+        parts = line.split(' ')
+
+        # Extract command text / code
+        command = ''
+        if parts[currentPart] and parts[currentPart][0] == '!':
+            command = parts[currentPart][1:]
+            currentPart += 1
+
+        # Extract parameters (if any)
+        params = []
+        while currentPart < len(parts):
+            # Work with non empty parts
+            if parts[currentPart]:
+                # Watch for ':' that will mark trailing parameter
+                if parts[currentPart][0] == ':':
+                    # Remove colon ':' from first part
+                    trailingParam = parts[currentPart][1:]
+                    currentPart += 1
+
+                    # Now we need to rebuild the string from rest of parts
+                    if currentPart < len(parts):
+                        trailingParam += ' ' + self.unsplit(parts[currentPart:])
+
+                    params.append(trailingParam)
+                    break
 
-                    messages.append(Message(command, params))
+                params.append(parts[currentPart])
+            currentPart += 1
 
-                # Save the rest of unprocessed data
-                textBuffer = lines[-1]
+        return Message(command, params)
 
-                # Now start processing
-                while len(messages) > 0:
-                    if not self.process(messages.pop(0)):
-                        return
+    def setReplyReady(self, reply):
+        handler = self.replyHandlers.get(reply.__class__)
+        if handler:
+            handler(reply)
 
-            except Exception, e:
-                print_error('Error occured while listening: ' + e.message)
-                self.mainQueue.put(QuitNotification())
-                return
+        # Any event shows the device is alive
+        if self.awaitReply():
+            self.setTimeout(self.drawingTimeout)
+        else:
+            self.deadline = None
+
+        self.sendPending()
+
+    def onInitialized(self, reply):
+        self.report("FITkit initialized")
+        self.initialized = True
+        self.credit = reply.credit
+        # Device starts with defaults after reset, settings go ahead of the waiting commands
+        settings = []
+        if self.telemetryInterval:
+            settings.append(MessageNotifiaction(Message('TELEMETRY', [str(self.telemetryInterval)]), ControlCommand()))
+        if self.settings.timeModel.feed:
+            settings.append(MessageNotifiaction(Message('FEED', [str(self.settings.timeModel.feed)]), DrawingCommand()))
+        self.commands[:0] = settings
+
+    def onDrawingStarted(self, reply):
+        command = self.inflight.get(reply.seq)
+        if command is not None and isinstance(command.id, ComplexDrawingCommand):
+            self.report("Complex drawing has started")
+        if command is not None and self.progress and hasattr(command.messageString, 'progressIndex'):
+            self.progress.started(command.messageString.progressIndex, time.time())
+
+    def onDrawingFinished(self, reply):
+        command = self.inflight.get(reply.seq)
+        if command is None:
+            return
 
-    def setReplyReady(self, reply):
-        self.sendQueue.put(ReplyNotification(reply))
+        if isinstance(command.id, ComplexDrawingCommand):
+            self.report("Complex drawing has finished")
+        if hasattr(command.messageString, 'jobIndex'):
+            self.checkpoint.completed(command.messageString.jobIndex)
+        if command.messageString.command == 'STOP':
+            # Device dropped everything it had queued
+            self.inflight.clear()
+            self.unacked = 0
+            self.report("Drawing has been stopped")
+            return
+        self.commandDone(reply.seq)
+
+    def onAccepted(self, reply):
+        if reply.seq in self.inflight:
+            self.unacked -= 1
+            self.credit = reply.credit
+
+    def onCredit(self, reply):
+        self.credit = reply.credit
+
+    def onPosition(self, reply):
+        self.report('Head at %g %g' % reply.position)
+        command = self.inflight.get(reply.seq)
+        if command is not None and command.messageString.command == 'STOP':
+            self.checkpoint.stopped(reply.position, reply.cutting)
+
+    def onTelemetry(self, reply):
+        command = self.inflight.get(reply.seq)
+        text = 'Head at %.1f %.1f mm, %d queued' % (reply.position[0], reply.position[1], reply.queued)
+        if command is not None and self.progress and hasattr(command.messageString, 'progressIndex'):
+            now = time.time()
+            self.progress.started(command.messageString.progressIndex, now)
+            text = '%5.1f %% (%d/%d), %s, ETA %s' % (100.0 * self.progress.fraction(now),
+                                                     self.progress.index + 1, self.progress.count(), text,
+                                                     formatDuration(self.progress.remaining(now)))
+        self.showProgress(text)
+
+    def onError(self, reply):
+        command = self.inflight.get(reply.seq)
+        if command is not None:
+            reply.errorText = '%s (%s)' % (reply.errorText, str(command.messageString).strip())
+            # Rejected command was never accepted
+            self.unacked -= 1
+            self.commandDone(reply.seq)
+        self.printReply(reply)
+
+    def onQuit(self, reply):
+        self.running = False
+
+    def commandDone(self, seq):
+        del self.inflight[seq]
+        if not self.inflight:
+            self.report("Drawing has finished")
+
+    # Number of leading numeric parameters of events
+    eventParams = {'INITIALIZED': 1, 'STARTED': 1, 'ACCEPTED': 2, 'FINISHED': 1, 'CREDIT': 1, 'ERROR': 1,
+                   'POSITION': 3, 'TELEMETRY': 4}
+
+    def parseNumbers(self, params, count):
+        if len(params) < count:
+            return None
+        try:
+            return [int(param) for param in params[:count]]
+        except ValueError:
+            return None
 
     def process(self, msg):
         assert isinstance(msg, Message)
         if msg.command:
+            values = self.parseNumbers(msg.params, self.eventParams.get(msg.command, 0))
+            if values is None:
+                print_error('Malformed event: !%s %s' % (msg.command, self.unsplit(msg.params)))
+                return True
+
             if msg.command == 'INITIALIZED':
-                self.setReplyReady(InitializedReply())
+                self.setReplyReady(InitializedReply(values[0]))
 
             if msg.command == 'STARTED':
-                self.setReplyReady(DrawingStartedReply())
+                self.setReplyReady(DrawingStartedReply(values[0]))
+
+            if msg.command == 'ACCEPTED':
+                self.setReplyReady(AcceptedReply(values[0], values[1]))
 
             if msg.command == 'FINISHED':
-                self.setReplyReady(DrawingFinishedReply())
+                self.setReplyReady(DrawingFinishedReply(values[0]))
+
+            if msg.command == 'CREDIT':
+                self.setReplyReady(CreditReply(values[0]))
+
+            if msg.command == 'POSITION':
+                # Cutting flag is optional, it is missing in older firmware
+                cutting = self.parseNumbers(msg.params[3:], 1)
+                self.setReplyReady(PositionReply(*(values + (cutting or [0]))))
 
-            if msg.command == 'COMPLEX_FINISHED':
-                self.setReplyReady(ComplexDrawingFinishedReply())
+            if msg.command == 'TELEMETRY':
+                self.setReplyReady(TelemetryReply(*values))
 
             if msg.command == 'ERROR':
-                self.setReplyReady(ErrorReply())
+                self.setReplyReady(ErrorReply(values[0], self.unsplit(msg.params[1:])))
 
             if msg.command == 'QUIT':
                 self.setReplyReady(QuitReply())
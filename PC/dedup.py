@@ -0,0 +1,215 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import math
+from shapes import Line, Circle, Arc, Bezier, Polyline
+from clip import distance
+from estimate import INTERNAL_STEP_MM
+
+# Width of direction cells of the hash, only candidates are found by it,
+# whether segments lie on the same line is decided by the tolerance
+ANGLE_CELL = 0.01
+ANGLE_CELLS = int(math.ceil(math.pi / ANGLE_CELL))
+
+
+class Segment:
+    def __init__(self, owner, index, start, end):
+        self.owner = owner
+        self.index = index
+        self.start = start
+        self.end = end
+
+
+class LineGroup:
+    """Segments lying on one line, positions along it are measured in direction u."""
+    def __init__(self, start, end):
+        length = distance(start, end)
+        self.u = ((end[0] - start[0]) / length, (end[1] - start[1]) / length)
+        self.origin = start
+        self.segments = []
+
+    def distanceTo(self, point):
+        dx, dy = point[0] - self.origin[0], point[1] - self.origin[1]
+        return abs(dx * self.u[1] - dy * self.u[0])
+
+    def position(self, point):
+        return (point[0] - self.origin[0]) * self.u[0] + (point[1] - self.origin[1]) * self.u[1]
+
+
+def lineKey(start, end, tolerance):
+    """Cell of line through segment: its direction and distance from origin."""
+    angle = math.atan2(end[1] - start[1], end[0] - start[0])
+    if angle < 0:
+        angle += math.pi
+    if angle >= math.pi:
+        angle -= math.pi
+    normal = (-math.sin(angle), math.cos(angle))
+    offset = start[0] * normal[0] + start[1] * normal[1]
+    return int(angle / ANGLE_CELL), offset / tolerance
+
+
+def neighbourKeys(key):
+    angleCell, offset = key
+    for da in (-1, 0, 1):
+        cell, cellOffset = angleCell + da, offset
+        if cell < 0 or cell >= ANGLE_CELLS:
+            # Direction wraps around, the normal points the other way
+            cell, cellOffset = cell % ANGLE_CELLS, -offset
+        base = int(math.floor(cellOffset))
+        for do in (-1, 0, 1):
+            yield cell, base + do
+
+
+def groupSegments(segments, tolerance):
+    """Sort segments into groups of collinear ones using spatial hash of lines."""
+    cells = {}
+    groups = []
+    for segment in segments:
+        key = lineKey(segment.start, segment.end, tolerance)
+        group = None
+        for neighbour in neighbourKeys(key):
+            for candidate in cells.get(neighbour, []):
+                if candidate.distanceTo(segment.start) <= tolerance and candidate.distanceTo(segment.end) <= tolerance:
+                    group = candidate
+                    break
+            if group:
+                break
+
+        if group is None:
+            group = LineGroup(segment.start, segment.end)
+            groups.append(group)
+            cells.setdefault((key[0], int(math.floor(key[1]))), []).append(group)
+        group.segments.append(segment)
+    return groups
+
+
+def mergeGroup(group, tolerance):
+    """Overlapping segments of group joined together, as list of
+    (start, end, segments). Segments that overlap no other are left out."""
+    intervals = []
+    for segment in group.segments:
+        a, b = group.position(segment.start), group.position(segment.end)
+        if a <= b:
+            intervals.append((a, b, segment.start, segment.end, segment))
+        else:
+            intervals.append((b, a, segment.end, segment.start, segment))
+    intervals.sort(key=lambda interval: interval[:2])
+
+    merged = []
+    for a, b, start, end, segment in intervals:
+        current = merged[-1] if merged else None
+        if current and a < current[1] - tolerance:
+            if b > current[1]:
+                current[1], current[3] = b, end
+            current[4].append(segment)
+        else:
+            merged.append([a, b, start, end, [segment]])
+
+    return [(start, end, segments) for a, b, start, end, segments in merged if len(segments) > 1]
+
+
+def shapeKey(shape, tolerance):
+    # Same key for shapes that differ less than tolerance
+    def q(value):
+        return int(round(value / tolerance))
+
+    if isinstance(shape, Circle):
+        return 'C', q(shape.center[0]), q(shape.center[1]), q(shape.radius)
+    if isinstance(shape, Arc):
+        return 'A', q(shape.center[0]), q(shape.center[1]), q(shape.radius), \
+            round(shape.startAngle % 360.0, 3), round(shape.getSweep(), 3)
+    if isinstance(shape, Bezier):
+        points = shape.points if shape.points[0] <= shape.points[-1] else list(reversed(shape.points))
+        return ('B',) + tuple(q(c) for p in points for c in p)
+    return None
+
+
+def shapeLength(shape):
+    if isinstance(shape, Circle):
+        return 2 * math.pi * shape.radius
+    if isinstance(shape, Arc):
+        return math.radians(shape.getSweep()) * shape.radius
+    if isinstance(shape, Bezier):
+        p = shape.points
+        return (distance(p[0], p[1]) + distance(p[1], p[2]) + distance(p[2], p[3]) + distance(p[0], p[3])) / 2
+    return 0.0
+
+
+def dedupShapes(shapes, tolerance=1.0):
+    """Drop duplicate shapes and merge collinear overlapping segments,
+    tolerance is in internal steps of the device.
+    Return new shapes and cut length in mm that was saved."""
+    tolerance *= INTERNAL_STEP_MM
+
+    # Curves are dropped only when the same one was seen before
+    seen = set()
+    kept = []
+    saved = 0.0
+    for shape in shapes:
+        key = shapeKey(shape, tolerance)
+        if key is not None:
+            if key in seen:
+                saved += shapeLength(shape)
+                continue
+            seen.add(key)
+        kept.append(shape)
+
+    # Lines and polyline edges are merged along their lines
+    segments = []
+    for owner, shape in enumerate(kept):
+        if isinstance(shape, Line):
+            vertices = [shape.start, shape.end]
+        elif isinstance(shape, Polyline):
+            vertices = shape.getVertices()
+        else:
+            continue
+        for index, (start, end) in enumerate(zip(vertices[:-1], vertices[1:])):
+            if distance(start, end) > tolerance:
+                segments.append(Segment(owner, index, start, end))
+
+    removed = set()
+    replacements = {}
+    for group in groupSegments(segments, tolerance):
+        if len(group.segments) < 2:
+            continue
+        for start, end, members in mergeGroup(group, tolerance):
+            saved += sum(distance(s.start, s.end) for s in members) - distance(start, end)
+            for segment in members:
+                removed.add((segment.owner, segment.index))
+            # Merged line is drawn where the first of its segments was
+            owner = min(segment.owner for segment in members)
+            replacements.setdefault(owner, []).append(Line(start, end))
+
+    if not removed:
+        return kept, saved
+
+    result = []
+    for owner, shape in enumerate(kept):
+        if isinstance(shape, (Line, Polyline)):
+            result.extend(keptParts(shape, owner, removed))
+        else:
+            result.append(shape)
+        result.extend(replacements.get(owner, []))
+    return result, saved
+
+
+def keptParts(shape, owner, removed):
+    """Shape without removed segments, polyline falls apart into runs of kept ones."""
+    if isinstance(shape, Line):
+        return [] if (owner, 0) in removed else [shape]
+
+    vertices = shape.getVertices()
+    if not any((owner, index) in removed for index in range(len(vertices) - 1)):
+        return [shape]
+
+    parts, run = [], []
+    for index, (start, end) in enumerate(zip(vertices[:-1], vertices[1:])):
+        if (owner, index) in removed:
+            if run:
+                parts.append(run)
+            run = []
+        else:
+            run = run or [start]
+            run.append(end)
+    if run:
+        parts.append(run)
+    return [Polyline(run) if len(run) > 2 else Line(run[0], run[1]) for run in parts]
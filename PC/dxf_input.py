@@ -2,7 +2,7 @@
 __author__ = 'Ivan'
 import ezdxf
 import os
-import math
+from shapes import Line, Circle, Arc, Polyline, shapesToCommands
 
 class DxfInput:
     def __init__(self, filename):
@@ -12,41 +12,30 @@ class DxfInput:
         self.dxf = ezdxf.readfile(filename)
         self.modelspace = self.dxf.modelspace()
 
-    def getCommands(self):
-        commands = []
+    def getShapes(self):
+        shapes = []
 
         for e in self.modelspace:
             if e.dxftype() == 'LINE':
-                command = ('LINE', [])
-                command[1].append('%d' % e.dxf.start[0])
-                command[1].append('%d' % e.dxf.start[1])
-                command[1].append('%d' % e.dxf.end[0])
-                command[1].append('%d' % e.dxf.end[1])
+                shape = Line(e.dxf.start, e.dxf.end)
 
             elif e.dxftype() == 'CIRCLE':
-                command = ('CIRCLE', [])
-                command[1].append('%d' % e.dxf.center[0])
-                command[1].append('%d' % e.dxf.center[1])
-                command[1].append('%d' % round(e.dxf.radius))
+                shape = Circle(e.dxf.center, e.dxf.radius)
 
             elif e.dxftype() == 'ARC':
-                x = round(e.dxf.center[0] + math.cos(e.dxf.start_angle / 180.0 * math.pi) * e.dxf.radius)
-                y = round(e.dxf.center[1] + math.sin(e.dxf.start_angle / 180.0 * math.pi) * e.dxf.radius)
-
-                command = ('MOVE', [])
-                command[1].append('%d' % x)
-                command[1].append('%d' % y)
-                commands.append(command)
+                shape = Arc(e.dxf.center, e.dxf.radius, e.dxf.start_angle, e.dxf.end_angle)
 
-                command = ('ARC', [])
-                command[1].append('%d' % e.dxf.center[0])
-                command[1].append('%d' % e.dxf.center[1])
-                command[1].append('%d' % -e.dxf.end_angle)
+            elif e.dxftype() == 'LWPOLYLINE':
+                # Bulges are not supported, vertices are connected by straight segments
+                shape = Polyline(e.get_points(), e.closed)
 
             else:
-                command = None
+                shape = None
 
-            if command:
-                commands.append(command)
+            if shape:
+                shapes.append(shape)
 
-        return commands
\ No newline at end of file
+        return shapes
+
+    def getCommands(self):
+        return shapesToCommands(self.getShapes())
@@ -0,0 +1,146 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import math
+from shapes import Line, Circle, Arc, Bezier, Polyline
+
+# Constants of the firmware, see FITkit/mcu/main.c
+TICK = 0.004
+INTERNAL_STEP_MM = 0.1
+MOTOR_X_STEP_MM = 0.1
+MOTOR_Y_STEP_MM = 0.12125
+# Homing from the farthest corner at the seek rate, roughly
+HOME_TIME = 10.0
+# Wait for the pen to rise or touch the paper
+PEN_DELAY = 0.1
+# Highest feed rate in mm/s the device accepts
+FEED_MAX = 1000
+
+
+def toSteps(value):
+    return int(round(value / INTERNAL_STEP_MM))
+
+
+class TimeModel:
+    """Drawing time as the firmware spends it, one tick per step of the head
+    and a wait for every pen lift and drop, cutting is slowed down to feed
+    rate in mm/s when it is set."""
+    def __init__(self, stepModeMove='full', stepModeDraw='half', feed=None):
+        self.stepModeMove = stepModeMove
+        self.stepModeDraw = stepModeDraw
+        self.feed = feed
+
+    def moveTime(self, start, end):
+        """Pen up move between points in millimeters."""
+        if toSteps(start[0]) == toSteps(end[0]) and toSteps(start[1]) == toSteps(end[1]):
+            # Head is already there, pen stays down
+            return 0.0
+
+        # Pen is lifted before the move and lowered after it
+        if self.stepModeMove == 'full':
+            # Motors head straight for the target, two half steps per tick
+            realX = abs(end[0] - start[0]) / MOTOR_X_STEP_MM
+            realY = abs(end[1] - start[1]) / MOTOR_Y_STEP_MM
+            return math.ceil(max(realX, realY) / 2.0) * TICK + 2 * PEN_DELAY
+
+        return self.stepTime(start, end) + 2 * PEN_DELAY
+
+    def stepTime(self, start, end):
+        # Bresenham makes one step of the longer axis per tick
+        return max(abs(toSteps(end[0]) - toSteps(start[0])), abs(toSteps(end[1]) - toSteps(start[1]))) * TICK
+
+    def feedTime(self, time, straight, diagonal):
+        # Feed rate holds steps back, diagonal ones are sqrt(2) times longer,
+        # but never makes them faster than one per tick
+        if not self.feed:
+            return time
+        return max(time, (straight + math.sqrt(2) * diagonal) * INTERNAL_STEP_MM / self.feed)
+
+    def cutTime(self, start, end):
+        dx, dy = abs(toSteps(end[0]) - toSteps(start[0])), abs(toSteps(end[1]) - toSteps(start[1]))
+        return self.feedTime(self.stepTime(start, end), abs(dx - dy), min(dx, dy))
+
+    def circleTime(self, radius):
+        # Each of eight octants takes R / sqrt(2) steps, R * (1 - 1 / sqrt(2)) of them diagonal
+        steps = toSteps(radius)
+        diagonal = steps * (1 - 1 / math.sqrt(2))
+        return self.feedTime(4 * math.sqrt(2) * steps * TICK, 8 * (steps / math.sqrt(2) - diagonal), 8 * diagonal)
+
+    def bezierTime(self, points):
+        # Device follows the curve by chords, the length is close enough
+        time = 0.0
+        count = 16
+        previous = points[0]
+        for i in range(1, count + 1):
+            t = float(i) / count
+            u = 1 - t
+            point = tuple(u * u * u * points[0][j] + 3 * u * u * t * points[1][j] +
+                          3 * u * t * t * points[2][j] + t * t * t * points[3][j] for j in range(2))
+            time += self.cutTime(previous, point)
+            previous = point
+        return time
+
+    def shapeTime(self, shape, position):
+        """Return time to draw shape from head position and position where it ends."""
+        if isinstance(shape, Line):
+            return self.moveTime(position, shape.start) + self.cutTime(shape.start, shape.end), shape.end
+
+        if isinstance(shape, Circle):
+            start = shape.getStart()
+            return self.moveTime(position, start) + self.circleTime(round(shape.radius)), start
+
+        if isinstance(shape, Bezier):
+            return self.moveTime(position, shape.points[0]) + self.bezierTime(shape.points), shape.points[-1]
+
+        if isinstance(shape, Arc):
+            time = 0.0
+            for bezier in shape.getBeziers():
+                shapeTime, position = self.shapeTime(bezier, position)
+                time += shapeTime
+            return time, position
+
+        if isinstance(shape, Polyline):
+            vertices = shape.getVertices()
+            if not vertices:
+                return 0.0, position
+            time = self.moveTime(position, vertices[0])
+            for start, end in zip(vertices[:-1], vertices[1:]):
+                time += self.cutTime(start, end)
+            return time, vertices[-1]
+
+        return 0.0, position
+
+    def commandTime(self, command, args, position):
+        """Device time of command with numeric arguments, drawn from head position,
+        and position where the command ends."""
+        if command == 'LINE':
+            start, end = (args[0], args[1]), (args[2], args[3])
+            return self.moveTime(position, start) + self.cutTime(start, end), end
+        if command == 'CIRCLE':
+            start = Circle((args[0], args[1]), args[2], args[3] if len(args) > 3 else 0).getStart()
+            return self.moveTime(position, start) + self.circleTime(args[2]), start
+        if command == 'CUT' or command == 'VERTEX':
+            end = (args[0], args[1])
+            return self.cutTime(position, end), end
+        if command == 'POLYLINE':
+            start = (args[0], args[1])
+            return self.moveTime(position, start), start
+        if command == 'BEZIER':
+            points = [(args[i], args[i + 1]) for i in range(0, 8, 2)]
+            return self.moveTime(position, points[0]) + self.bezierTime(points), points[3]
+        return 0.0, position
+
+    def commandsTime(self, commands, position=(0, 0)):
+        """Time in seconds the device takes to run commands."""
+        time = 0.0
+        for id, params in commands:
+            commandTime, position = self.commandTime(id, [float(param) for param in params], position)
+            time += commandTime
+        return time
+
+    def estimate(self, shapes, position=(0, 0)):
+        """Time in seconds to draw shapes in given order."""
+        time = 0.0
+        for shape in shapes:
+            shapeTime, position = self.shapeTime(shape, position)
+            time += shapeTime
+        return time
@@ -0,0 +1,236 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import argparse
+import random
+import time
+
+import fitkit.fitkit as fitkit
+from commander import FitKitClient, Message, DrawingCommand, openChannel, print_error
+from dxf_input import DxfInput
+from shapes import Line, Circle
+from clip import WorkArea, clipShapes
+from preprocess import Settings, preprocess
+from loopback import LoopbackManager
+
+
+class Job:
+    def __init__(self, name, shapes, settings):
+        self.name = name
+        # Same pipeline as plotter uses, the drawing comes out the same
+        self.commands = []
+        for part in preprocess(shapes, settings, log=lambda text: None):
+            self.commands.extend(part)
+        # Estimated from what the device runs, not from the shapes
+        self.estimate = settings.timeModel.commandsTime(self.commands)
+        self.lastMessage = None
+        self.client = None
+        self.startTime = None
+        self.finishTime = None
+
+
+def splitSheets(shapes, count, area):
+    """Split drawing into vertical strips of area, each moved onto its own sheet."""
+    width = (area.maxX - area.minX) / float(count)
+    sheets = []
+    for i in range(count):
+        strip = WorkArea(area.minX + i * width, area.minY, area.minX + (i + 1) * width, area.maxY)
+        visible, dropped = clipShapes(shapes, strip)
+        sheets.append([shape.translate(-i * width, 0) for shape in visible])
+    return sheets
+
+
+class Farm:
+    """Drives several plotters from one event loop. Jobs wait in a shared
+    queue, longest first, and go to the device with the least estimated work."""
+    def __init__(self, settings=None):
+        self.settings = settings or Settings()
+        self.clients = []
+        self.jobs = []
+        self.assigned = {}
+        self.finished = []
+        # Device with less work than this (s) gets next job while still drawing,
+        # so it does not stand still between jobs
+        self.lookahead = 5.0
+        self.pollTimeout = 5
+        self.running = False
+
+    def acquire(self, manager):
+        count = manager.discover()
+        for i in range(count):
+            device = manager.acquire()
+            if device is None:
+                break
+            self.addDevice(device)
+        return len(self.clients)
+
+    def addDevice(self, device):
+        client = FitKitClient()
+        client.name = device['b'].serial()
+        # Progress lines of more devices would overwrite each other
+        client.telemetryInterval = 0
+        client.attach(openChannel(device))
+        self.clients.append(client)
+        self.assigned[client] = []
+
+    def submit(self, job):
+        self.jobs.append(job)
+        self.jobs.sort(key=lambda j: -j.estimate)
+
+    def isDone(self, job):
+        if job.lastMessage is None:
+            # Nothing to draw, e.g. empty sheet
+            return True
+        seq = job.lastMessage.seq
+        return seq is not None and seq not in job.client.inflight
+
+    def collectFinished(self, client):
+        """Move finished jobs of client out of its assigned ones."""
+        for job in [job for job in self.assigned[client] if self.isDone(job)]:
+            job.finishTime = time.time()
+            self.assigned[client].remove(job)
+            self.finished.append(job)
+
+    def outstanding(self, client):
+        """Estimated time of jobs assigned to client and not finished yet."""
+        return sum(job.estimate for job in self.assigned[client])
+
+    def dispatch(self):
+        while self.jobs:
+            ready = [client for client in self.clients
+                     if client.running and client.initialized and not client.commands]
+            if not ready:
+                return
+            for client in ready:
+                self.collectFinished(client)
+            client = min(ready, key=self.outstanding)
+            if self.outstanding(client) > self.lookahead:
+                return
+
+            job = self.jobs.pop(0)
+            job.client = client
+            job.startTime = time.time()
+            for id, params in job.commands:
+                job.lastMessage = Message(id, params)
+                client.queueToSend(job.lastMessage, DrawingCommand())
+            self.assigned[client].append(job)
+
+    def dropFailed(self):
+        for client in [client for client in self.clients if not client.running]:
+            print_error('%s: device failed, its jobs are put back to queue' % client.name)
+            for job in self.assigned.pop(client):
+                if not self.isDone(job):
+                    self.submit(job)
+            self.clients.remove(client)
+
+    def busy(self):
+        return self.jobs or any(not client.isIdle() for client in self.clients)
+
+    def run(self):
+        self.running = True
+        while self.running and self.clients and self.busy():
+            self.dispatch()
+
+            received = False
+            for client in self.clients:
+                if client.pollDevice(0):
+                    received = True
+                client.checkTimeout()
+
+            self.dropFailed()
+            if not received:
+                time.sleep(self.pollTimeout / 1000.0)
+
+        for client in self.clients:
+            self.collectFinished(client)
+
+
+def randomJobs(count, settings, seed=1):
+    generator = random.Random(seed)
+    jobs = []
+    for i in range(count):
+        shapes = []
+        for j in range(generator.randint(5, 40)):
+            x, y = generator.randint(20, 180), generator.randint(20, 180)
+            if generator.random() < 0.3:
+                shapes.append(Circle((x, y), generator.randint(2, 15)))
+            else:
+                shapes.append(Line((x, y), (generator.randint(20, 180), generator.randint(20, 180))))
+        jobs.append(Job('random%d' % i, shapes, settings))
+    return jobs
+
+
+def benchmark(devices, jobs, speedup):
+    """Run random jobs on loopback devices, report makespan against the ideal one."""
+    farm = Farm()
+    farm.acquire(LoopbackManager(devices, speedup))
+    for job in randomJobs(jobs, farm.settings):
+        farm.submit(job)
+
+    # Initialization is not a part of dispatching
+    while not all(client.initialized for client in farm.clients):
+        for client in farm.clients:
+            client.pollDevice(farm.pollTimeout)
+
+    start = time.time()
+    farm.run()
+    makespan = (time.time() - start) * speedup
+
+    # Ideal is the work devices really did spread evenly, estimates of jobs
+    # don't know where the head of each device comes from
+    estimated = sum(job.estimate for job in farm.finished)
+    total = sum(client.comChannel.busyTime for client in farm.clients)
+    print 'Jobs: %d, devices: %d, estimated work: %.1f s, done work: %.1f s' % (len(farm.finished), devices,
+                                                                                estimated, total)
+    print 'Makespan: %.1f s, ideal: %.1f s, efficiency: %.1f %%' % (makespan, total / devices,
+                                                                    100.0 * total / devices / makespan)
+    for client in farm.clients:
+        print '%s: busy %.1f s' % (client.name, client.comChannel.busyTime)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Plot drawings on all connected plotters.')
+    parser.add_argument('files', nargs='*')
+    parser.add_argument('-a', nargs=4, type=float, metavar=('MINX', 'MINY', 'MAXX', 'MAXY'))
+    parser.add_argument('-s', '--split', type=int, metavar='N', help='split each drawing into N sheets')
+    parser.add_argument('-l', '--loopback', type=int, metavar='N', help='use N loopback devices')
+    parser.add_argument('--speedup', type=float, default=1.0, help='time speedup of loopback devices')
+    parser.add_argument('-b', '--benchmark', type=int, metavar='JOBS', help='dispatch random jobs')
+    parser.add_argument('--simplify', type=float, metavar='STEPS')
+    parser.add_argument('--dedup', type=float, metavar='STEPS')
+    args = parser.parse_args()
+
+    if args.benchmark:
+        benchmark(args.loopback or 4, args.benchmark, args.speedup)
+        return
+
+    farm = Farm()
+    if args.loopback:
+        farm.acquire(LoopbackManager(args.loopback, args.speedup))
+    elif farm.acquire(fitkit.DeviceMgr()) < 1:
+        print_error('No device')
+        return
+
+    area = WorkArea(*args.a) if args.a else None
+    # Sheets are clipped to the area again by preprocessing, it does not change them
+    farm.settings.workArea = area
+    farm.settings.simplify = args.simplify
+    farm.settings.dedup = args.dedup
+    for filename in args.files:
+        shapes = DxfInput(filename).getShapes()
+        if args.split:
+            if not area:
+                print_error('Splitting needs work area.')
+                return
+            shapes, dropped = clipShapes(shapes, area)
+            for i, sheet in enumerate(splitSheets(shapes, args.split, area)):
+                farm.submit(Job('%s#%d' % (filename, i), sheet, farm.settings))
+        else:
+            farm.submit(Job(filename, shapes, farm.settings))
+
+    farm.run()
+    for job in farm.finished:
+        print '%s: drawn on %s' % (job.name, job.client.name)
+
+
+if __name__ == '__main__':
+    main()
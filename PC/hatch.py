@@ -0,0 +1,139 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import math
+from shapes import Circle, Polyline, samePoint, chainLines
+from clip import distance
+from transform import rotation
+
+
+def closedContours(shapes):
+    """Closed outlines of drawing as lists of points, first point is not repeated."""
+    contours = []
+    # Outline may be drawn as separate lines
+    for shape in chainLines(shapes):
+        if isinstance(shape, Polyline):
+            points = shape.points
+            if len(points) > 2 and not shape.closed and samePoint(points[0], points[-1]):
+                points = points[:-1]
+            if len(points) > 2 and (shape.closed or len(points) < len(shape.points)):
+                contours.append(points)
+
+        elif isinstance(shape, Circle):
+            count = max(16, int(2 * math.pi * shape.radius))
+            cx, cy = shape.center
+            contours.append([(cx + math.cos(2 * math.pi * i / count) * shape.radius,
+                              cy + math.sin(2 * math.pi * i / count) * shape.radius) for i in range(count)])
+
+    return contours
+
+
+def edges(contours):
+    for contour in contours:
+        for i in range(len(contour)):
+            yield contour[i - 1], contour[i]
+
+
+def scanline(contours, y):
+    """Inside parts of horizontal line by even-odd rule, as sorted (x1, x2) pairs."""
+    crossings = []
+    for a, b in edges(contours):
+        # Half open range, so a vertex on the line is counted once
+        if (a[1] <= y) != (b[1] <= y):
+            crossings.append(a[0] + (y - a[1]) * (b[0] - a[0]) / (b[1] - a[1]))
+
+    crossings.sort()
+    return [(crossings[i], crossings[i + 1]) for i in range(0, len(crossings) - 1, 2)]
+
+
+def crosses(start, end, contours):
+    """True if segment properly crosses any contour edge."""
+    dx, dy = end[0] - start[0], end[1] - start[1]
+    for a, b in edges(contours):
+        ex, ey = b[0] - a[0], b[1] - a[1]
+        denominator = dx * ey - dy * ex
+        if abs(denominator) < 1e-12:
+            continue
+        t = ((a[0] - start[0]) * ey - (a[1] - start[1]) * ex) / denominator
+        u = ((a[0] - start[0]) * dy - (a[1] - start[1]) * dx) / denominator
+        if 1e-6 < t < 1 - 1e-6 and 0 <= u <= 1:
+            return True
+    return False
+
+
+def hatchStrips(contours, pitch):
+    """Scan contours by lines pitch apart and group the inside parts into strips,
+    each strip takes at most one part of every line and the parts overlap."""
+    ys = [p[1] for contour in contours for p in contour]
+    if not ys:
+        return []
+
+    strips = []
+    active = []
+    y = min(ys) + pitch / 2.0
+    while y < max(ys):
+        extended = []
+        for x1, x2 in scanline(contours, y):
+            for strip in active:
+                last = strip[-1]
+                if last[0] < x2 and x1 < last[1] and not any(s is strip for s in extended):
+                    strip.append((x1, x2, y))
+                    extended.append(strip)
+                    break
+            else:
+                strip = [(x1, x2, y)]
+                strips.append(strip)
+                extended.append(strip)
+        # Strip that skipped a line is not continued
+        active = extended
+        y += pitch
+
+    return strips
+
+
+def stripPolylines(strip, contours):
+    """Join parts of strip in alternating direction, pen stays down between
+    them unless the link would leave the region."""
+    polylines = []
+    points = []
+    for i, (x1, x2, y) in enumerate(strip):
+        start, end = ((x1, y), (x2, y)) if i % 2 == 0 else ((x2, y), (x1, y))
+        if points and crosses(points[-1], start, contours):
+            polylines.append(points)
+            points = []
+        points.extend([start, end])
+    if points:
+        polylines.append(points)
+    return polylines
+
+
+def orderPolylines(polylines, position=(0, 0)):
+    """Greedy nearest neighbour ordering, polylines may be reversed."""
+    remaining = list(polylines)
+    ordered = []
+    while remaining:
+        best = min(remaining, key=lambda p: min(distance(position, p[0]), distance(position, p[-1])))
+        remaining.remove(best)
+        if distance(position, best[-1]) < distance(position, best[0]):
+            best = best[::-1]
+        ordered.append(best)
+        position = best[-1]
+    return ordered
+
+
+def hatchShapes(shapes, pitch, angle=0.0):
+    """Hatch lines filling closed contours of shapes, pitch in millimeters
+    and angle of lines in degrees."""
+    contours = closedContours(shapes)
+    if not contours or pitch <= 0:
+        return []
+
+    # Scan in rotated space, so the hatch lines are horizontal
+    toScan, back = rotation(-angle), rotation(angle)
+    contours = [[toScan.apply(p) for p in contour] for contour in contours]
+
+    polylines = []
+    for strip in hatchStrips(contours, pitch):
+        polylines.extend(stripPolylines(strip, contours))
+
+    polylines = [[back.apply(p) for p in points] for points in polylines]
+    return [Polyline(points) for points in orderPolylines(polylines)]
@@ -0,0 +1,238 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import time
+from estimate import TimeModel, HOME_TIME
+
+
+class LoopbackChannel:
+    """Stand-in for the FITkit channel, speaks the firmware protocol and
+    takes as long as the device would, divided by speedup."""
+    Ok = 0
+    queueSize = 8
+
+    def __init__(self, name='loopback', speedup=1.0):
+        self.name = name
+        self.speedup = speedup
+        self.model = TimeModel()
+        self.clock = time.time
+        self.reset()
+
+    def reset(self):
+        self.output = ''
+        self.input = ''
+        self.queue = []
+        self.current = None
+        self.finishTime = None
+        self.position = (0, 0)
+        # Telemetry period in device seconds, off when None
+        self.telemetryInterval = None
+        self.nextTelemetry = 0.0
+        # Busy time in device seconds, for benchmarks
+        self.busyTime = 0.0
+        self.start = self.clock()
+        self.homedAt = self.now() + HOME_TIME
+
+    def now(self):
+        return (self.clock() - self.start) * self.speedup
+
+    # IOChannel interface
+
+    def open(self):
+        return LoopbackChannel.Ok
+
+    def close(self):
+        pass
+
+    def resetMCU(self):
+        self.reset()
+
+    def resetMcu(self):
+        self.reset()
+
+    def setRts(self, value):
+        pass
+
+    def setDtr(self, value):
+        pass
+
+    def serial(self):
+        return self.name
+
+    def product(self):
+        return 'Loopback'
+
+    def write(self, data, count):
+        for ch in data[:count]:
+            if ch == '\n':
+                self.processLine(self.input.strip())
+                self.input = ''
+            else:
+                self.input += ch
+
+    def read(self, count, timeout):
+        self.advance()
+        if not self.output and timeout > 0:
+            # Sleep until the next event, but no longer than the timeout
+            wait = timeout / 1000.0
+            nextEvent = self.nextEventTime()
+            if nextEvent is not None:
+                wait = min(wait, max(0.0, (nextEvent - self.now()) / self.speedup))
+            time.sleep(wait)
+            self.advance()
+
+        data = self.output[:count]
+        self.output = self.output[count:]
+        return data
+
+    # Device simulation
+
+    def send(self, text):
+        self.output += text + '\r\n'
+
+    def nextEventTime(self):
+        if self.homedAt is not None:
+            return self.homedAt
+        if self.current is None:
+            return None
+        return self.finishTime
+
+    def advance(self):
+        now = self.now()
+        if self.homedAt is not None:
+            if now < self.homedAt:
+                return
+            self.homedAt = None
+            self.send('!INITIALIZED %d' % self.queueSize)
+
+        while True:
+            if self.current is not None:
+                if now < self.finishTime:
+                    self.telemetry(now)
+                    return
+                self.send('!FINISHED %d' % self.current[0])
+                self.current = None
+
+            if not self.queue:
+                return
+
+            seq, command, duration, arrival, end = self.queue.pop(0)
+            self.current = (seq, command, end)
+            self.send('!STARTED %d' % seq)
+            self.send('!CREDIT %d' % (self.queueSize - len(self.queue)))
+            self.busyTime += duration
+            # Queued command starts right when the previous one ends
+            if self.finishTime is None or arrival > self.finishTime:
+                self.finishTime = arrival
+            self.finishTime += duration
+
+    def telemetry(self, now):
+        if self.telemetryInterval is None or now < self.nextTelemetry:
+            return
+        # Head is reported where the running command ends, it is not simulated in between
+        seq, command, end = self.current
+        self.send('!TELEMETRY %d %d %d %d' % (seq, end[0] * 10, end[1] * 10, len(self.queue)))
+        self.nextTelemetry = now + self.telemetryInterval
+
+    def isBusy(self):
+        return self.current is not None or self.queue or self.homedAt is not None
+
+    argumentCounts = {'LINE': (4,), 'CIRCLE': (3, 4), 'CUT': (2,), 'POLYLINE': (2,), 'VERTEX': (2,),
+                      'POLYEND': (0,), 'BEZIER': (8,), 'FEED': (1,)}
+
+    def processLine(self, line):
+        seq = 0
+        if line.startswith('@'):
+            seqStr, _, line = line[1:].partition(' ')
+            seq = int(seqStr)
+
+        parts = line.split()
+        if not parts:
+            return
+        command = parts[0].upper()
+
+        try:
+            args = [int(part) for part in parts[1:]]
+        except ValueError:
+            self.send('!ERROR %d :Error at argument.' % seq)
+            return
+
+        if command in ('STOP', 'WHERE'):
+            if command == 'STOP':
+                self.queue = []
+                self.current = None
+            self.send('!ACCEPTED %d %d' % (seq, self.queueSize))
+            # Queued commands are simulated at once, the head is where the last one ends
+            # and no command is interrupted while cutting
+            self.send('!POSITION %d %d %d 0' % (seq, self.position[0] * 10, self.position[1] * 10))
+            self.send('!FINISHED %d' % seq)
+        elif command in self.argumentCounts:
+            if len(args) not in self.argumentCounts[command]:
+                self.send('!ERROR %d :Too few arguments.' % seq)
+            elif len(self.queue) >= self.queueSize:
+                self.send('!ERROR %d :Queue is full.' % seq)
+            elif command == 'FEED' and not 0 <= args[0] <= 1000:
+                self.send('!ERROR %d :Error at argument.' % seq)
+            else:
+                if command == 'FEED':
+                    # Applies to commands queued after it, they are simulated in order
+                    self.model.feed = args[0] or None
+                # Commands are simulated in the order they come, head position
+                # after the queued ones is where the new one starts from
+                duration, self.position = self.model.commandTime(command, args, self.position)
+                self.queue.append((seq, command, duration, self.now(), self.position))
+                self.send('!ACCEPTED %d %d' % (seq, self.queueSize - len(self.queue)))
+                self.advance()
+        elif command == 'TELEMETRY':
+            if len(args) != 1 or not (args[0] == 0 or 100 <= args[0] <= 60000):
+                self.send('!ERROR %d :Error at argument.' % seq)
+                return
+            self.send('!ACCEPTED %d %d' % (seq, self.queueSize - len(self.queue)))
+            self.telemetryInterval = args[0] / 1000.0 if args[0] else None
+            self.nextTelemetry = self.now()
+            self.send('!FINISHED %d' % seq)
+        elif command in ('HOME', 'CALIBRATE', 'STEPMODE'):
+            if self.isBusy():
+                self.send('!ERROR %d :Device is busy.' % seq)
+                return
+            self.send('!ACCEPTED %d %d' % (seq, self.queueSize))
+            if command == 'STEPMODE':
+                if len(parts) == 3 and parts[1].upper() == 'MOVE':
+                    self.model.stepModeMove = parts[2].lower()
+                elif len(parts) == 3 and parts[1].upper() == 'DRAW':
+                    self.model.stepModeDraw = parts[2].lower()
+            else:
+                # Homing blocks the device, simulated as an immediate one
+                self.send('!STARTED %d' % seq)
+                self.position = (0, 0)
+            self.send('!FINISHED %d' % seq)
+        else:
+            self.send('!ERROR %d :Not supported by loopback device.' % seq)
+
+
+class LoopbackDevice:
+    """Stand-in for fitkit.Device."""
+    def __init__(self, name, speedup=1.0):
+        self.channel = LoopbackChannel(name, speedup)
+
+    def vid(self):
+        return 0
+
+    def pid(self):
+        return 0
+
+    def __getitem__(self, key):
+        return self.channel
+
+
+class LoopbackManager:
+    """Stand-in for fitkit.DeviceMgr with given number of devices."""
+    def __init__(self, count, speedup=1.0):
+        self.devices = [LoopbackDevice('LOOP%d' % i, speedup) for i in range(count)]
+
+    def discover(self):
+        return len(self.devices)
+
+    def acquire(self):
+        if not self.devices:
+            return None
+        return self.devices.pop(0)
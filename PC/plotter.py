@@ -1,7 +1,11 @@
 # !/usr/bin/env python
 import signal
 import argparse
-from commander import FitKitClient, print_error
+from commander import FitKitClient, print_error, validTelemetry, TELEMETRY_MIN_MS, TELEMETRY_MAX_MS
+from clip import WorkArea
+from transform import Transform
+from recorder import Recorder
+from estimate import FEED_MAX
 
 # noinspection PyUnusedLocal
 def sigTermHandler(signum, frame):
@@ -34,6 +38,12 @@ def processArguments(args):
     if not mode:
         mode = FitKitClient.fullMode
 
+    if args['feed'] is not None and not 0 <= args['feed'] <= FEED_MAX:
+        raise Exception('Argument error: feed rate must be 0 to %d mm/s.' % FEED_MAX)
+    if args['telemetry'] is not None and not validTelemetry(args['telemetry']):
+        raise Exception('Argument error: telemetry interval must be 0 or %d to %d ms.' %
+                        (TELEMETRY_MIN_MS, TELEMETRY_MAX_MS))
+
     return mode
 
 
@@ -42,6 +52,17 @@ def mainProcess(fitKitClient):
     parser.add_argument('-l', action='store_true')
     parser.add_argument('-w', action='store_true')
     parser.add_argument('-f', action='store_true')
+    parser.add_argument('-a', nargs=4, type=float, metavar=('MINX', 'MINY', 'MAXX', 'MAXY'))
+    parser.add_argument('-t', nargs=4, type=float, metavar=('SCALE', 'ANGLE', 'DX', 'DY'))
+    parser.add_argument('--fit', action='store_true')
+    parser.add_argument('--orient', type=float, metavar='STEP')
+    parser.add_argument('--hatch', nargs=2, type=float, metavar=('PITCH', 'ANGLE'))
+    parser.add_argument('--simplify', type=float, metavar='STEPS')
+    parser.add_argument('--dedup', type=float, metavar='STEPS')
+    parser.add_argument('-j', '--workers', type=int, metavar='N')
+    parser.add_argument('--record', metavar='LOG')
+    parser.add_argument('--telemetry', type=int, metavar='MS')
+    parser.add_argument('--feed', type=int, metavar='MM/S')
 
     try:
         args = parser.parse_args()
@@ -55,6 +76,25 @@ def mainProcess(fitKitClient):
         print_error(e.message)
         return
 
+    if args.a:
+        fitKitClient.settings.workArea = WorkArea(*args.a)
+    if args.t:
+        fitKitClient.settings.transform = Transform(*args.t)
+    fitKitClient.settings.fitToArea = args.fit
+    fitKitClient.settings.orientStep = args.orient
+    if args.hatch:
+        fitKitClient.settings.hatch = tuple(args.hatch)
+    fitKitClient.settings.simplify = args.simplify
+    fitKitClient.settings.dedup = args.dedup
+    if args.workers:
+        fitKitClient.workers = args.workers
+    if args.feed:
+        fitKitClient.settings.timeModel.feed = args.feed
+    if args.telemetry is not None:
+        fitKitClient.telemetryInterval = args.telemetry
+    if args.record:
+        fitKitClient.recorder = Recorder(args.record)
+
     try:
         fitKitClient.run(mode)
     except Exception, e:
@@ -63,8 +103,10 @@ def mainProcess(fitKitClient):
         fitKitClient.close()
 
 
-signal.signal(signal.SIGTERM, sigTermHandler)
-signal.signal(signal.SIGINT, sigTermHandler)
-fitKitClient = FitKitClient()
+# Workers of preprocessing import this module on some systems, they must not start the client
+if __name__ == '__main__':
+    signal.signal(signal.SIGTERM, sigTermHandler)
+    signal.signal(signal.SIGINT, sigTermHandler)
+    fitKitClient = FitKitClient()
 
-mainProcess(fitKitClient)
\ No newline at end of file
+    mainProcess(fitKitClient)
\ No newline at end of file
@@ -0,0 +1,273 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import argparse
+import itertools
+import math
+import multiprocessing
+import random
+import time
+from shapes import Line, Circle, samePoint, orderedCommands
+from clip import WorkArea, clipShapes
+from estimate import TimeModel
+from transform import transformShapes, bounds, mergeBounds, fitTransform, orientationCandidate
+from dedup import dedupShapes
+from hatch import hatchShapes
+from simplify import simplifyShapes
+
+# Shapes handed to a worker at once
+CHUNK_SIZE = 2000
+# Smaller drawings are not worth starting workers for
+PARALLEL_MIN_SHAPES = 4 * CHUNK_SIZE
+
+
+class Settings:
+    """How drawings are preprocessed before they are sent to the device."""
+    def __init__(self):
+        # Drawings are clipped to this area, when set
+        self.workArea = None
+        # Drawings are transformed, scaled to fill work area and rotated
+        # by multiples of orientStep (degrees) to draw fastest, when set
+        self.transform = None
+        self.fitToArea = False
+        self.orientStep = None
+        self.timeModel = TimeModel()
+        # Closed contours are filled by lines of this pitch and angle, when set
+        self.hatch = None
+        # Paths are simplified with this tolerance in device steps, when set
+        self.simplify = None
+        # Duplicate and overlapping shapes are merged with this tolerance in device steps, when set
+        self.dedup = None
+
+
+class Workers:
+    """Pool of worker processes sharing list of chunks, or the calling process alone.
+    Workers get the chunks when they start, tasks refer to them by index."""
+    def __init__(self, count, chunks):
+        if count > 1 and len(chunks) > 1:
+            self.pool = multiprocessing.Pool(min(count, len(chunks)), setChunks, (chunks,))
+        else:
+            self.pool = None
+            setChunks(chunks)
+
+    def map(self, function, items):
+        return self.pool.map(function, items) if self.pool else map(function, items)
+
+    def imap(self, function, items):
+        # Results come in order, each as soon as it is ready
+        return self.pool.imap(function, items) if self.pool else itertools.imap(function, items)
+
+    def close(self):
+        if self.pool:
+            self.pool.terminate()
+            self.pool.join()
+        setChunks(None)
+
+
+def splitChunks(shapes, size=CHUNK_SIZE):
+    """Consecutive parts of about size shapes, lines joined into one
+    polyline are never split."""
+    chunks, chunk = [], []
+    for shape in shapes:
+        if len(chunk) >= size and not (isinstance(shape, Line) and isinstance(chunk[-1], Line) and
+                                       samePoint(chunk[-1].end, shape.start)):
+            chunks.append(chunk)
+            chunk = []
+        chunk.append(shape)
+    if chunk:
+        chunks.append(chunk)
+    return chunks
+
+
+# Work of one worker, arguments come in one tuple so they can be mapped
+
+sharedChunks = None
+
+
+def setChunks(chunks):
+    global sharedChunks
+    sharedChunks = chunks
+
+
+def transformedChunk(index, transform):
+    chunk = sharedChunks[index]
+    return transformShapes(chunk, transform) if transform else chunk
+
+
+def chunkBounds(args):
+    return bounds(transformedChunk(*args))
+
+
+def transformChunk(args):
+    return transformedChunk(*args)
+
+
+def orientationTime(args):
+    result = orientationCandidate(sharedChunks[0], *args)
+    return result[1] if result else None
+
+
+def finishChunk(args):
+    """Stages that work on every shape alone: transformation, clipping and simplification."""
+    index, transform, settings = args
+    chunk = transformedChunk(index, transform)
+    dropped, before, after = 0.0, 0, 0
+    if settings.workArea:
+        chunk, dropped = clipShapes(chunk, settings.workArea)
+    if settings.simplify:
+        chunk, before, after = simplifyShapes(chunk, settings.simplify)
+    return chunk, dropped, before, after
+
+
+def wholeDrawingStages(shapes, settings, workers, log):
+    """Stages that need all shapes at once, orientation candidates are tried in parallel."""
+    if settings.dedup:
+        # Duplicate edges would also cancel each other out in hatching
+        shapes, saved = dedupShapes(shapes, settings.dedup)
+        log('Removed duplicates, saved %.1f mm of cut' % saved)
+
+    if settings.workArea and settings.orientStep:
+        angles = [i * settings.orientStep for i in range(int(math.ceil(360.0 / settings.orientStep)))]
+        pool = Workers(workers, [shapes] * len(angles))
+        try:
+            times = pool.map(orientationTime, [(settings.workArea, settings.timeModel, angle) for angle in angles])
+        finally:
+            pool.close()
+
+        best = None
+        for angle, estimate in zip(angles, times):
+            if estimate is not None and (best is None or estimate < best[1]):
+                best = (angle, estimate)
+        if best:
+            shapes = orientationCandidate(shapes, settings.workArea, settings.timeModel, best[0])[0]
+            log('Rotated by %g degrees, estimated time %.1f s' % best)
+        else:
+            log('Drawing does not fit into work area in any orientation.')
+
+    if settings.hatch:
+        shapes = shapes + hatchShapes(shapes, *settings.hatch)
+
+    return shapes
+
+
+def preprocess(shapes, settings, workers=1, log=None):
+    """Run drawing through all preprocessing stages, yield its commands in parts
+    as soon as each part is ready. Large drawings are split into chunks processed
+    by a pool of workers, stages that need the whole drawing run between them."""
+    if log is None:
+        def log(text):
+            print text
+
+    if len(shapes) < PARALLEL_MIN_SHAPES:
+        workers = 1
+
+    chunks = splitChunks(shapes)
+    pool = Workers(workers, chunks)
+    try:
+        # Transform and fitting into area are done by workers in one pass with the rest
+        transform = settings.transform
+        if settings.workArea and settings.fitToArea:
+            box = mergeBounds(pool.map(chunkBounds, [(i, transform) for i in range(len(chunks))]))
+            if box is not None:
+                fit = fitTransform(box, settings.workArea)
+                transform = transform.then(fit) if transform else fit
+
+        if settings.dedup or settings.hatch or (settings.workArea and settings.orientStep):
+            shapes = [shape for chunk in pool.map(transformChunk, [(i, transform) for i in range(len(chunks))])
+                      for shape in chunk]
+            pool.close()
+            shapes = wholeDrawingStages(shapes, settings, workers, log)
+            chunks = splitChunks(shapes)
+            pool = Workers(workers, chunks)
+            transform = None
+
+        # Parts are ordered as they come, each starts where the previous one ends
+        dropped, before, after = 0.0, 0, 0
+        position = (0, 0)
+        for chunk, chunkDropped, chunkBefore, chunkAfter in pool.imap(finishChunk, [(i, transform, settings)
+                                                                                    for i in range(len(chunks))]):
+            dropped += chunkDropped
+            before += chunkBefore
+            after += chunkAfter
+            commands, position = orderedCommands(chunk, position)
+            yield commands
+
+        if dropped > 0:
+            log('Clipped %.1f mm of drawing outside of work area %s' % (dropped, settings.workArea))
+        if settings.simplify:
+            log('Simplified %d segments to %d' % (before, after))
+    finally:
+        pool.close()
+
+
+def randomDrawing(count, seed=1):
+    """Drawing like a scanned one: noisy curves of tiny segments, some edges twice."""
+    generator = random.Random(seed)
+    shapes = []
+    while len(shapes) < count:
+        x, y = generator.uniform(0, 180), generator.uniform(0, 180)
+        angle = generator.uniform(0, 2 * math.pi)
+        for i in range(generator.randint(20, 200)):
+            angle += generator.uniform(-0.1, 0.1)
+            end = (x + math.cos(angle) * 0.3 + generator.uniform(-0.02, 0.02),
+                   y + math.sin(angle) * 0.3 + generator.uniform(-0.02, 0.02))
+            shapes.append(Line((x, y), end))
+            x, y = end
+        if generator.random() < 0.1:
+            shapes.append(Circle((generator.uniform(10, 170), generator.uniform(10, 170)), generator.uniform(1, 10)))
+        if generator.random() < 0.05:
+            shapes.extend(shapes[-10:])
+    return shapes
+
+
+def benchmark(shapes, settings, workerCounts):
+    print '%d shapes' % len(shapes)
+    print '%8s %14s %10s %9s' % ('workers', 'first part [s]', 'total [s]', 'commands')
+    baseline = None
+    for workers in workerCounts:
+        start = time.time()
+        first = None
+        commands = []
+        for part in preprocess(shapes, settings, workers, log=lambda text: None):
+            if first is None:
+                first = time.time() - start
+            commands.extend(part)
+        total = time.time() - start
+
+        # Parallel run has to give the same drawing
+        if baseline is None:
+            baseline = commands
+        elif commands != baseline:
+            print 'Commands differ with %d workers' % workers
+        print '%8d %14.3f %10.3f %9d' % (workers, first or total, total, len(commands))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure preprocessing time with growing number of workers.')
+    parser.add_argument('dxf', nargs='?', help='drawing to preprocess, random one when not given')
+    parser.add_argument('-n', '--shapes', type=int, default=100000, help='size of random drawing')
+    parser.add_argument('-w', '--workers', type=int, nargs='+',
+                        default=sorted(set([1, 2, 4, multiprocessing.cpu_count()])))
+    parser.add_argument('--simplify', type=float, default=1.0, metavar='STEPS')
+    parser.add_argument('--dedup', type=float, metavar='STEPS')
+    parser.add_argument('--orient', type=float, metavar='STEP')
+    args = parser.parse_args()
+
+    if args.dxf:
+        from dxf_input import DxfInput
+        shapes = DxfInput(args.dxf).getShapes()
+    else:
+        shapes = randomDrawing(args.shapes)
+
+    settings = Settings()
+    settings.workArea = WorkArea(0, 0, 180, 180)
+    settings.fitToArea = True
+    settings.simplify = args.simplify
+    settings.dedup = args.dedup
+    settings.orientStep = args.orient
+
+    print '%d cores' % multiprocessing.cpu_count()
+    benchmark(shapes, settings, args.workers)
+
+
+if __name__ == '__main__':
+    main()
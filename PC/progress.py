@@ -0,0 +1,71 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+
+# Estimates are trusted as they are until this much of the drawing (in seconds) is done
+MIN_MEASURED_TIME = 5.0
+
+
+def formatDuration(seconds):
+    seconds = int(round(seconds))
+    return '%d:%02d:%02d' % (seconds // 3600, seconds // 60 % 60, seconds % 60)
+
+
+class Progress:
+    """Progress of a drawing through its commands and time to its end.
+    Every command has its time from the time model, the remaining time is
+    scaled by how fast the device went so far compared to the model."""
+    def __init__(self, model, position=(0, 0)):
+        self.model = model
+        # Where the last added command ends
+        self.position = position
+        self.estimates = []
+        self.total = 0.0
+        # Estimated time of the commands before the drawn one
+        self.done = 0.0
+        self.index = None
+        self.startTime = None
+        self.startDone = 0.0
+        self.commandStart = None
+
+    def add(self, commands):
+        """Add commands that follow, return index of the first one."""
+        first = len(self.estimates)
+        for id, params in commands:
+            time, self.position = self.model.commandTime(id, [float(param) for param in params], self.position)
+            self.estimates.append(time)
+            self.total += time
+        return first
+
+    def count(self):
+        return len(self.estimates)
+
+    def started(self, index, now):
+        # Commands start in order, they may be reported late but never go back
+        if self.index is not None and index <= self.index:
+            return
+        if self.index is None:
+            self.startTime = now
+            self.done = self.startDone = sum(self.estimates[:index])
+        else:
+            self.done += sum(self.estimates[self.index:index])
+        self.index = index
+        self.commandStart = now
+
+    def current(self, now):
+        # Model time spent in the drawn command, it is never over its estimate
+        return min(now - self.commandStart, self.estimates[self.index])
+
+    def fraction(self, now):
+        if self.index is None or self.total == 0:
+            return 0.0
+        return (self.done + self.current(now)) / self.total
+
+    def remaining(self, now):
+        """Seconds to the end of the drawing, None before it starts."""
+        if self.index is None:
+            return None
+        rate = 1.0
+        measured = self.done - self.startDone
+        if measured >= MIN_MEASURED_TIME:
+            rate = (self.commandStart - self.startTime) / measured
+        return max(0.0, (self.total - self.done) * rate - (now - self.commandStart))
@@ -0,0 +1,103 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import ctypes
+import ctypes.util
+import sys
+import time
+
+# Ids of monotonic clock of clock_gettime
+CLOCK_MONOTONIC = {'linux': 1, 'darwin': 6}
+
+
+class Timespec(ctypes.Structure):
+    _fields_ = [('seconds', ctypes.c_long), ('nanoseconds', ctypes.c_long)]
+
+
+def systemMonotonic():
+    """clock_gettime with monotonic clock, None when the system has none."""
+    clockId = CLOCK_MONOTONIC.get(sys.platform.rstrip('0123456789'))
+    if clockId is None:
+        return None
+    # Older glibc has it in librt only
+    for name in ('c', 'rt'):
+        path = ctypes.util.find_library(name)
+        try:
+            function = ctypes.CDLL(path).clock_gettime
+        except (OSError, AttributeError):
+            continue
+        function.argtypes = [ctypes.c_int, ctypes.POINTER(Timespec)]
+        value = Timespec()
+
+        def monotonic():
+            if function(clockId, ctypes.byref(value)) != 0:
+                raise OSError('clock_gettime failed')
+            return value.seconds + value.nanoseconds * 1e-9
+        return monotonic
+    return None
+
+
+class ClampedClock:
+    """Wall clock that never goes back, a step back stops it until the time catches up."""
+    def __init__(self, source):
+        self.source = source
+        self.last = None
+
+    def __call__(self):
+        now = self.source()
+        if self.last is not None and now < self.last:
+            now = self.last
+        self.last = now
+        return now
+
+
+def monotonicClock():
+    if hasattr(time, 'monotonic'):
+        return time.monotonic
+    if sys.platform == 'win32':
+        # Performance counter on Windows, it does not follow the wall clock
+        return time.clock
+    return systemMonotonic() or ClampedClock(time.time)
+
+
+# Gaps and latencies of the log must not be broken by NTP or DST changes
+clock = monotonicClock()
+
+SENT = '>'
+RECEIVED = '<'
+RESET = '!'
+
+
+class Recorder:
+    """Log of serial traffic, one line per record: seconds since start,
+    direction and the text without line end."""
+    def __init__(self, path):
+        self.file = open(path, 'w')
+        self.start = clock()
+
+    def record(self, kind, text):
+        self.file.write('%.4f %s %s\n' % (clock() - self.start, kind, text.rstrip('\r\n')))
+        self.file.flush()
+
+    def sent(self, text):
+        self.record(SENT, text)
+
+    def received(self, text):
+        self.record(RECEIVED, text)
+
+    def reset(self):
+        self.record(RESET, '')
+
+    def close(self):
+        self.file.close()
+
+
+def readLog(path):
+    """Return list of (time, kind, text) records."""
+    records = []
+    with open(path) as f:
+        for line in f:
+            parts = line.rstrip('\r\n').split(' ', 2)
+            if len(parts) < 2:
+                continue
+            records.append((float(parts[0]), parts[1], parts[2] if len(parts) > 2 else ''))
+    return records
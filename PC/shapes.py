@@ -0,0 +1,211 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import math
+
+
+def formatCoord(value):
+    return '%d' % value
+
+
+class Line:
+    def __init__(self, start, end):
+        self.start = (start[0], start[1])
+        self.end = (end[0], end[1])
+
+    def translate(self, dx, dy):
+        return Line((self.start[0] + dx, self.start[1] + dy), (self.end[0] + dx, self.end[1] + dy))
+
+    def getCommands(self):
+        return [('LINE', [formatCoord(self.start[0]), formatCoord(self.start[1]),
+                          formatCoord(self.end[0]), formatCoord(self.end[1])])]
+
+
+class Circle:
+    # Device draws clockwise, starting and ending at the beginning of octant,
+    # octants are numbered clockwise from the top
+    def __init__(self, center, radius, octant=0):
+        self.center = (center[0], center[1])
+        self.radius = radius
+        self.octant = octant
+
+    def translate(self, dx, dy):
+        return Circle((self.center[0] + dx, self.center[1] + dy), self.radius, self.octant)
+
+    def getStartAngle(self):
+        return 90.0 - 45.0 * self.octant
+
+    def getStart(self):
+        # Device uses the rounded radius
+        angle = math.radians(self.getStartAngle())
+        radius = round(self.radius)
+        return (self.center[0] + math.cos(angle) * radius, self.center[1] + math.sin(angle) * radius)
+
+    def getCommands(self):
+        params = [formatCoord(self.center[0]), formatCoord(self.center[1]), formatCoord(round(self.radius))]
+        if self.octant:
+            params.append('%d' % self.octant)
+        return [('CIRCLE', params)]
+
+
+class Bezier:
+    # Cubic Bezier curve given by start, two control points and end
+    def __init__(self, points):
+        self.points = [(p[0], p[1]) for p in points]
+
+    def translate(self, dx, dy):
+        return Bezier([(x + dx, y + dy) for x, y in self.points])
+
+    def getCommands(self):
+        params = []
+        for x, y in self.points:
+            params.append(formatCoord(round(x)))
+            params.append(formatCoord(round(y)))
+        return [('BEZIER', params)]
+
+
+class Arc:
+    # Angles are in degrees, arc goes counterclockwise from start to end
+    def __init__(self, center, radius, startAngle, endAngle):
+        self.center = (center[0], center[1])
+        self.radius = radius
+        self.startAngle = startAngle
+        self.endAngle = endAngle
+
+    def translate(self, dx, dy):
+        return Arc((self.center[0] + dx, self.center[1] + dy), self.radius, self.startAngle, self.endAngle)
+
+    def getSweep(self):
+        sweep = (self.endAngle - self.startAngle) % 360.0
+        if sweep == 0:
+            sweep = 360.0
+        return sweep
+
+    def getBeziers(self):
+        # Approximate by cubic curves spanning at most 90 degrees each
+        sweep = self.getSweep()
+        count = int(math.ceil(sweep / 90.0))
+        step = sweep / count / 180.0 * math.pi
+        k = 4.0 / 3.0 * math.tan(step / 4.0) * self.radius
+
+        beziers = []
+        angle = self.startAngle / 180.0 * math.pi
+        cx, cy = self.center
+        for i in range(count):
+            a0, a1 = angle, angle + step
+            p0 = (cx + math.cos(a0) * self.radius, cy + math.sin(a0) * self.radius)
+            p3 = (cx + math.cos(a1) * self.radius, cy + math.sin(a1) * self.radius)
+            p1 = (p0[0] - math.sin(a0) * k, p0[1] + math.cos(a0) * k)
+            p2 = (p3[0] + math.sin(a1) * k, p3[1] - math.cos(a1) * k)
+            beziers.append(Bezier([p0, p1, p2, p3]))
+            angle = a1
+
+        return beziers
+
+    def getCommands(self):
+        # Device evaluates the curves itself, no need to flatten them here
+        commands = []
+        for bezier in self.getBeziers():
+            commands.extend(bezier.getCommands())
+        return commands
+
+
+class Polyline:
+    def __init__(self, points, closed=False):
+        self.points = [(p[0], p[1]) for p in points]
+        self.closed = closed
+
+    def translate(self, dx, dy):
+        return Polyline([(x + dx, y + dy) for x, y in self.points], self.closed)
+
+    def getVertices(self):
+        if self.closed and self.points:
+            return self.points + [self.points[0]]
+        return list(self.points)
+
+    def getCommands(self):
+        vertices = self.getVertices()
+        if not vertices:
+            return []
+
+        # Whole polyline is drawn by device without stopping at vertices
+        commands = [('POLYLINE', [formatCoord(vertices[0][0]), formatCoord(vertices[0][1])])]
+        for x, y in vertices[1:]:
+            commands.append(('VERTEX', [formatCoord(x), formatCoord(y)]))
+        commands.append(('POLYEND', []))
+
+        return commands
+
+
+def samePoint(a, b):
+    # Device works with whole millimeters
+    return formatCoord(a[0]) == formatCoord(b[0]) and formatCoord(a[1]) == formatCoord(b[1])
+
+
+def chainLines(shapes):
+    """Join consecutive lines that share end points into polylines."""
+    result = []
+    chain = []
+
+    def flush():
+        if len(chain) == 1:
+            result.append(Line(chain[0][0], chain[0][1]))
+        elif chain:
+            result.append(Polyline([chain[0][0]] + [end for start, end in chain]))
+        del chain[:]
+
+    for shape in shapes:
+        if isinstance(shape, Line):
+            if chain and not samePoint(chain[-1][1], shape.start):
+                flush()
+            chain.append((shape.start, shape.end))
+        else:
+            flush()
+            result.append(shape)
+
+    flush()
+    return result
+
+
+def endPoint(shape, position):
+    """Position of head after shape is drawn from given position."""
+    if isinstance(shape, Line):
+        return shape.end
+    if isinstance(shape, Circle):
+        return shape.getStart()
+    if isinstance(shape, Bezier):
+        return shape.points[-1]
+    if isinstance(shape, Arc):
+        return shape.getBeziers()[-1].points[-1]
+    if isinstance(shape, Polyline):
+        vertices = shape.getVertices()
+        return vertices[-1] if vertices else position
+    return position
+
+
+def startCircles(shapes, position=(0, 0)):
+    """Start every circle in the octant nearest to where the head comes from."""
+    result = []
+    for shape in shapes:
+        if isinstance(shape, Circle):
+            candidates = [Circle(shape.center, shape.radius, octant) for octant in range(8)]
+            shape = min(candidates, key=lambda circle: math.hypot(circle.getStart()[0] - position[0],
+                                                                  circle.getStart()[1] - position[1]))
+        result.append(shape)
+        position = endPoint(shape, position)
+    return result
+
+
+def orderedCommands(shapes, position=(0, 0)):
+    """Commands drawing shapes from head position and position where they end."""
+    commands = []
+
+    for shape in startCircles(chainLines(shapes), position):
+        commands.extend(shape.getCommands())
+        position = endPoint(shape, position)
+
+    return commands, position
+
+
+def shapesToCommands(shapes):
+    # Head is at the origin after homing
+    return orderedCommands(shapes)[0]
@@ -0,0 +1,87 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import math
+from shapes import Line, Polyline, samePoint, chainLines
+from estimate import INTERNAL_STEP_MM
+
+
+def pointToSegment(point, start, end):
+    # Projection is clamped to the segment, point beyond its end may be a turn back
+    dx, dy = end[0] - start[0], end[1] - start[1]
+    length = dx * dx + dy * dy
+    t = 0.0
+    if length > 0:
+        t = max(0.0, min(1.0, ((point[0] - start[0]) * dx + (point[1] - start[1]) * dy) / length))
+    return math.hypot(point[0] - start[0] - t * dx, point[1] - start[1] - t * dy)
+
+
+def douglasPeucker(points, tolerance):
+    """Keep only points farther than tolerance from the simplified path.
+    First and last point are always kept."""
+    if len(points) < 3:
+        return list(points)
+
+    keep = [False] * len(points)
+    keep[0] = keep[-1] = True
+    # Explicit stack, long polylines would exceed recursion limit
+    stack = [(0, len(points) - 1)]
+    while stack:
+        first, last = stack.pop()
+        farthest, index = 0.0, None
+        for i in range(first + 1, last):
+            d = pointToSegment(points[i], points[first], points[last])
+            if d > farthest:
+                farthest, index = d, i
+        if index is not None and farthest > tolerance:
+            keep[index] = True
+            stack.append((first, index))
+            stack.append((index, last))
+
+    return [point for point, kept in zip(points, keep) if kept]
+
+
+def dropRepeated(points):
+    # Device works with whole millimeters, such vertices would not move the head
+    result = points[:1]
+    for point in points[1:-1]:
+        if not samePoint(result[-1], point):
+            result.append(point)
+    if len(points) > 1:
+        if len(result) > 1 and samePoint(result[-1], points[-1]):
+            result[-1] = points[-1]
+        else:
+            result.append(points[-1])
+    return result
+
+
+def segmentCount(shapes):
+    count = 0
+    for shape in shapes:
+        if isinstance(shape, Polyline):
+            count += max(0, len(shape.getVertices()) - 1)
+        else:
+            count += 1
+    return count
+
+
+def simplifyShapes(shapes, tolerance):
+    """Simplify lines and polylines, tolerance is in internal steps of the device.
+    Return simplified shapes, number of segments before and after."""
+    tolerance *= INTERNAL_STEP_MM
+    shapes = chainLines(shapes)
+    before = segmentCount(shapes)
+
+    result = []
+    for shape in shapes:
+        if isinstance(shape, Polyline) and len(shape.points) > 1:
+            points = dropRepeated(douglasPeucker(shape.getVertices(), tolerance))
+            if shape.closed and len(points) > 3:
+                # Closing vertex is added by the polyline itself
+                shape = Polyline(points[:-1], True)
+            elif len(points) > 2:
+                shape = Polyline(points)
+            else:
+                shape = Line(points[0], points[-1])
+        result.append(shape)
+
+    return result, before, segmentCount(result)
@@ -0,0 +1,186 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import argparse
+
+from recorder import readLog, SENT, RECEIVED, RESET
+from loopback import LoopbackChannel
+from estimate import TICK
+
+# Gap between commands shorter than this (s) is only the tick boundary
+GAP_THRESHOLD = 2 * TICK
+
+
+class CommandTiming:
+    def __init__(self, seq, command, sent):
+        self.seq = seq
+        self.command = command
+        self.sent = sent
+        self.accepted = None
+        self.started = None
+        self.finished = None
+
+
+def parseTimings(records):
+    """Timing of every numbered command, in order of sending."""
+    timings = {}
+    order = []
+    for t, kind, text in records:
+        if kind == RESET:
+            # Sequence numbers start again
+            timings = {}
+            continue
+
+        parts = text.split()
+        if not parts:
+            continue
+
+        if kind == SENT and parts[0].startswith('@'):
+            timing = CommandTiming(int(parts[0][1:]), parts[1] if len(parts) > 1 else '', t)
+            timings[timing.seq] = timing
+            order.append(timing)
+
+        elif kind == RECEIVED and parts[0] in ('!ACCEPTED', '!STARTED', '!FINISHED') and len(parts) > 1:
+            timing = timings.get(int(parts[1]))
+            if timing is not None:
+                setattr(timing, parts[0][1:].lower(), t)
+
+    return order
+
+
+def stats(values):
+    if not values:
+        return 'n/a'
+    return 'mean %.3f s, max %.3f s' % (sum(values) / len(values), max(values))
+
+
+def report(records, window=10.0, verbose=False):
+    timings = parseTimings(records)
+    drawn = [timing for timing in timings if timing.started is not None and timing.finished is not None]
+
+    print 'Commands: %d sent, %d drawn' % (len(timings), len(drawn))
+    if verbose:
+        print '%6s %-9s %9s %9s %9s' % ('seq', 'command', 'accept', 'start', 'draw')
+        for timing in drawn:
+            # Acceptance may be lost or come before the log started
+            accepted = '%9.3f' % (timing.accepted - timing.sent) if timing.accepted is not None else 'n/a'
+            print '%6d %-9s %9s %9.3f %9.3f' % (timing.seq, timing.command, accepted,
+                                                timing.started - timing.sent, timing.finished - timing.started)
+
+    print 'Send -> accept: %s' % stats([t.accepted - t.sent for t in timings if t.accepted is not None])
+    print 'Send -> start:  %s' % stats([t.started - t.sent for t in drawn])
+    print 'Start -> finish: %s' % stats([t.finished - t.started for t in drawn])
+
+    # Device stands still between finish of one command and start of the next.
+    # When the next one was sent only after that, the host kept it waiting.
+    hostGaps, deviceGaps = [], []
+    for previous, timing in zip(drawn[:-1], drawn[1:]):
+        gap = timing.started - previous.finished
+        if gap > GAP_THRESHOLD:
+            if timing.sent > previous.finished:
+                hostGaps.append(gap)
+            else:
+                deviceGaps.append(gap)
+
+    print 'Idle gaps caused by host: %d, %.3f s in total' % (len(hostGaps), sum(hostGaps))
+    print 'Idle gaps with command on the way: %d, %.3f s in total' % (len(deviceGaps), sum(deviceGaps))
+
+    if drawn:
+        print 'Throughput (commands finished per %g s):' % window
+        begin = drawn[0].started
+        buckets = {}
+        for timing in drawn:
+            bucket = int((timing.finished - begin) / window)
+            buckets[bucket] = buckets.get(bucket, 0) + 1
+        for bucket in range(max(buckets) + 1):
+            count = buckets.get(bucket, 0)
+            print '%8.1f s %5d %s' % (bucket * window, count, '#' * min(count, 60))
+
+
+class VirtualClock:
+    def __init__(self):
+        self.now = 0.0
+
+    def __call__(self):
+        return self.now
+
+
+def replay(records):
+    """Send the recorded commands to the loopback device at the recorded times.
+    The device runs on virtual time, so replay is instant and repeatable.
+    Return records of the replayed session."""
+    clock = VirtualClock()
+    channel = LoopbackChannel('replay')
+    channel.clock = clock
+    channel.reset()
+
+    replayed = []
+
+    # Homing takes as long as it did in the recording
+    initialized = [t for t, kind, text in records if kind == RECEIVED and text.startswith('!INITIALIZED')]
+
+    def homeUntil(t):
+        later = [i for i in initialized if i >= t]
+        if later:
+            channel.homedAt = later[0]
+
+    homeUntil(0.0)
+
+    def collect():
+        channel.advance()
+        for line in channel.output.split('\r\n')[:-1]:
+            replayed.append((clock.now, RECEIVED, line))
+        channel.output = ''
+
+    def runUntil(t):
+        # Step through device events up to time t
+        while True:
+            nextEvent = channel.nextEventTime()
+            if nextEvent is None or nextEvent > t:
+                break
+            clock.now = max(clock.now, nextEvent)
+            collect()
+        clock.now = max(clock.now, t)
+        collect()
+
+    for t, kind, text in records:
+        if kind == SENT:
+            runUntil(t)
+            replayed.append((clock.now, SENT, text))
+            channel.write(text + '\r\n', len(text) + 2)
+            collect()
+        elif kind == RESET:
+            runUntil(t)
+            channel.reset()
+            # Device time stays the same as the time of the log
+            channel.start = 0.0
+            homeUntil(t)
+            replayed.append((clock.now, RESET, ''))
+
+    # Let the device finish everything queued
+    while channel.nextEventTime() is not None and channel.isBusy():
+        runUntil(channel.nextEventTime())
+
+    return replayed
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Analyze serial traffic recorded by plotter.py --record.')
+    parser.add_argument('log')
+    parser.add_argument('-w', '--window', type=float, default=10.0, help='throughput window in seconds')
+    parser.add_argument('-v', '--verbose', action='store_true', help='list every command')
+    parser.add_argument('-r', '--replay', action='store_true',
+                        help='replay the commands against loopback device and compare')
+    args = parser.parse_args()
+
+    records = readLog(args.log)
+    print '== Recorded'
+    report(records, args.window, args.verbose)
+
+    if args.replay:
+        print
+        print '== Replayed on loopback device'
+        report(replay(records), args.window, args.verbose)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,172 @@
+# !/usr/bin/env python
+__author__ = 'Ivan'
+import math
+from shapes import Line, Circle, Arc, Bezier, Polyline
+from clip import WorkArea
+
+
+class Transform:
+    """Similarity transform, point is scaled, rotated counterclockwise by angle
+    in degrees around origin and then translated."""
+    def __init__(self, scale=1.0, angle=0.0, dx=0.0, dy=0.0):
+        self.scale = scale
+        self.angle = angle
+        self.dx = dx
+        self.dy = dy
+
+    def apply(self, point):
+        a = math.radians(self.angle)
+        # Exact for multiples of 90 degrees, so the coordinates stay whole
+        cos, sin = round(math.cos(a), 12), round(math.sin(a), 12)
+        x, y = point[0] * self.scale, point[1] * self.scale
+        return (x * cos - y * sin + self.dx, x * sin + y * cos + self.dy)
+
+    def then(self, other):
+        """Transform applying this one first and the other one after it."""
+        dx, dy = other.apply((self.dx, self.dy))
+        return Transform(self.scale * other.scale, self.angle + other.angle, dx, dy)
+
+    def __str__(self):
+        return 'scale %g, rotate %g, move %g %g' % (self.scale, self.angle, self.dx, self.dy)
+
+
+def translation(dx, dy):
+    return Transform(dx=dx, dy=dy)
+
+
+def rotation(angle):
+    return Transform(angle=angle)
+
+
+def scaling(scale):
+    return Transform(scale=scale)
+
+
+def transformShape(shape, transform):
+    if isinstance(shape, Line):
+        return Line(transform.apply(shape.start), transform.apply(shape.end))
+
+    if isinstance(shape, Circle):
+        return Circle(transform.apply(shape.center), shape.radius * transform.scale)
+
+    if isinstance(shape, Arc):
+        return Arc(transform.apply(shape.center), shape.radius * transform.scale,
+                   shape.startAngle + transform.angle, shape.endAngle + transform.angle)
+
+    if isinstance(shape, Bezier):
+        return Bezier([transform.apply(p) for p in shape.points])
+
+    if isinstance(shape, Polyline):
+        return Polyline([transform.apply(p) for p in shape.points], shape.closed)
+
+    return shape
+
+
+def transformShapes(shapes, transform):
+    return [transformShape(shape, transform) for shape in shapes]
+
+
+def shapePoints(shape):
+    """Points whose bounding box contains the shape."""
+    if isinstance(shape, Line):
+        return [shape.start, shape.end]
+
+    if isinstance(shape, Circle):
+        cx, cy = shape.center
+        r = shape.radius
+        return [(cx - r, cy - r), (cx + r, cy + r)]
+
+    if isinstance(shape, Arc):
+        # Curve lies inside convex hull of its control points
+        points = []
+        for bezier in shape.getBeziers():
+            points.extend(bezier.points)
+        return points
+
+    if isinstance(shape, Bezier):
+        return shape.points
+
+    if isinstance(shape, Polyline):
+        return shape.points
+
+    return []
+
+
+def bounds(shapes):
+    points = []
+    for shape in shapes:
+        points.extend(shapePoints(shape))
+
+    if not points:
+        return None
+
+    return WorkArea(min(p[0] for p in points), min(p[1] for p in points),
+                    max(p[0] for p in points), max(p[1] for p in points))
+
+
+def mergeBounds(boxes):
+    boxes = [box for box in boxes if box is not None]
+    if not boxes:
+        return None
+
+    return WorkArea(min(box.minX for box in boxes), min(box.minY for box in boxes),
+                    max(box.maxX for box in boxes), max(box.maxY for box in boxes))
+
+
+def fits(box, area):
+    return (box.maxX - box.minX <= area.maxX - area.minX + 1e-9 and
+            box.maxY - box.minY <= area.maxY - area.minY + 1e-9)
+
+
+def placeInArea(shapes, area):
+    """Move shapes into lower left corner of area."""
+    box = bounds(shapes)
+    if box is None:
+        return shapes
+    return transformShapes(shapes, translation(area.minX - box.minX, area.minY - box.minY))
+
+
+def fitTransform(box, area):
+    """Transform scaling box to fill area keeping its proportions and placing it into it."""
+    width, height = box.maxX - box.minX, box.maxY - box.minY
+    scales = []
+    if width > 0:
+        scales.append((area.maxX - area.minX) / float(width))
+    if height > 0:
+        scales.append((area.maxY - area.minY) / float(height))
+    scale = min(scales) if scales else 1.0
+
+    return Transform(scale, 0.0, area.minX - box.minX * scale, area.minY - box.minY * scale)
+
+
+def fitToArea(shapes, area):
+    """Scale shapes to fill area keeping their proportions and place them into it."""
+    box = bounds(shapes)
+    if box is None:
+        return shapes
+
+    return transformShapes(shapes, fitTransform(box, area))
+
+
+def orientationCandidate(shapes, area, model, angle):
+    """Drawing rotated by angle and placed into area with its estimated time,
+    or None when it does not fit."""
+    candidate = placeInArea(transformShapes(shapes, rotation(angle)), area)
+    box = bounds(candidate)
+    if box is not None and not fits(box, area):
+        return None
+
+    return candidate, model.estimate(candidate)
+
+
+def optimizeOrientation(shapes, area, model, angles=(0, 90, 180, 270)):
+    """Try drawing rotated by each of the angles, placed into area.
+    Return the fastest candidate that fits, its angle and estimated time,
+    or None when no candidate fits."""
+    best = None
+    for angle in angles:
+        result = orientationCandidate(shapes, area, model, angle)
+        if result is not None and (best is None or result[1] < best[2]):
+            best = (result[0], angle, result[1])
+
+    return best